@@ -0,0 +1,507 @@
+#pragma once
+
+#include "graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Contraction hierarchy over a DirectedWeightedGraph. Vertices are contracted one by one
+  // in order of importance; whenever removing a vertex would break a shortest path,
+  // a shortcut arc is added instead. Queries are bidirectional Dijkstra searches that only
+  // go "upwards" in the order, and shortcuts are unpacked back into original edge ids.
+  template <typename Weight>
+  class ContractionHierarchy {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    explicit ContractionHierarchy(const Graph& graph);
+
+    std::optional<Weight> FindRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+    size_t GetShortcutCount() const;
+
+    template <typename Writer>
+    void Save(Writer& writer) const;
+    template <typename Reader>
+    static ContractionHierarchy Load(Reader& reader);
+
+  private:
+    ContractionHierarchy() = default;
+
+    using ArcId = size_t;
+    static constexpr ArcId NO_ARC = std::numeric_limits<ArcId>::max();
+    static constexpr size_t WITNESS_SETTLE_LIMIT = 500;
+
+    struct Arc {
+      VertexId from;
+      VertexId to;
+      Weight weight;
+      EdgeId original_edge;
+      ArcId first_half = NO_ARC;   // shortcuts only: from -> via
+      ArcId second_half = NO_ARC;  // shortcuts only: via -> to
+
+      bool IsShortcut() const {
+        return first_half != NO_ARC;
+      }
+    };
+
+    struct QueueItem {
+      Weight weight;
+      VertexId vertex;
+
+      bool operator < (const QueueItem& other) const {
+        return other.weight < weight;
+      }
+    };
+
+    // Preprocessing state, dropped once the hierarchy is built
+    struct Contraction {
+      std::vector<std::vector<ArcId>> out_arcs;
+      std::vector<std::vector<ArcId>> in_arcs;
+      std::vector<int> contracted_neighbours;
+
+      std::vector<std::optional<Weight>> witness_weights;
+      std::vector<VertexId> witness_touched;
+      std::vector<bool> is_witness_target;
+    };
+
+    struct Shortcut {
+      ArcId first_half;
+      ArcId second_half;
+    };
+
+    void InitializeArcs(const Graph& graph, Contraction& contraction);
+    void Contract(Contraction& contraction);
+    std::vector<Shortcut> FindShortcuts(Contraction& contraction, VertexId vertex) const;
+    void RunWitnessSearch(Contraction& contraction, VertexId source, VertexId skipped, Weight limit,
+                          size_t target_count) const;
+    int ComputePriority(const Contraction& contraction, VertexId vertex, const std::vector<Shortcut>& shortcuts) const;
+    void AddShortcut(Contraction& contraction, const Shortcut& shortcut);
+    void DetachVertex(Contraction& contraction, VertexId vertex);
+
+    void UnpackArc(ArcId arc_id, std::vector<EdgeId>& edges) const;
+
+    std::vector<Arc> arcs_;
+    std::vector<size_t> rank_;
+    size_t shortcut_count_ = 0;
+
+    // Upward arcs leaving each vertex, and upward arcs entering each vertex
+    // (traversed backwards by the reverse search)
+    std::vector<std::vector<ArcId>> upward_out_;
+    std::vector<std::vector<ArcId>> upward_in_;
+
+    struct SearchSpace {
+      std::vector<std::optional<Weight>> weights;
+      std::vector<ArcId> parent_arcs;
+      std::vector<VertexId> touched;
+
+      void Reset(size_t vertex_count) {
+        for (const VertexId vertex : touched) {
+          weights[vertex].reset();
+        }
+        touched.clear();
+        if (weights.size() != vertex_count) {
+          weights.assign(vertex_count, std::nullopt);
+          parent_arcs.assign(vertex_count, NO_ARC);
+        }
+      }
+    };
+  };
+
+
+  template <typename Weight>
+  ContractionHierarchy<Weight>::ContractionHierarchy(const Graph& graph)
+      : rank_(graph.GetVertexCount())
+  {
+    Contraction contraction;
+    InitializeArcs(graph, contraction);
+    Contract(contraction);
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::InitializeArcs(const Graph& graph, Contraction& contraction) {
+    const size_t vertex_count = graph.GetVertexCount();
+    upward_out_.resize(vertex_count);
+    upward_in_.resize(vertex_count);
+    contraction.out_arcs.resize(vertex_count);
+    contraction.in_arcs.resize(vertex_count);
+    contraction.contracted_neighbours.assign(vertex_count, 0);
+    contraction.witness_weights.assign(vertex_count, std::nullopt);
+    contraction.is_witness_target.assign(vertex_count, false);
+
+    // Only the lightest of parallel edges can lie on a shortest path
+    std::vector<EdgeId> edge_ids;
+    edge_ids.reserve(graph.GetEdgeCount());
+    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+      for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
+        const auto& edge = graph.GetEdge(edge_id);
+        assert(edge.weight >= 0);
+        if (edge.from != edge.to) {
+          edge_ids.push_back(edge_id);
+        }
+      }
+    }
+    std::sort(edge_ids.begin(), edge_ids.end(), [&graph](EdgeId lhs, EdgeId rhs) {
+      const auto& lhs_edge = graph.GetEdge(lhs);
+      const auto& rhs_edge = graph.GetEdge(rhs);
+      if (lhs_edge.from != rhs_edge.from || lhs_edge.to != rhs_edge.to) {
+        return std::tie(lhs_edge.from, lhs_edge.to) < std::tie(rhs_edge.from, rhs_edge.to);
+      }
+      return lhs_edge.weight < rhs_edge.weight;
+    });
+
+    for (size_t idx = 0; idx < edge_ids.size(); ++idx) {
+      const auto& edge = graph.GetEdge(edge_ids[idx]);
+      if (idx > 0) {
+        const auto& prev_edge = graph.GetEdge(edge_ids[idx - 1]);
+        if (prev_edge.from == edge.from && prev_edge.to == edge.to) {
+          continue;
+        }
+      }
+      const ArcId arc_id = arcs_.size();
+      arcs_.push_back({edge.from, edge.to, edge.weight, edge_ids[idx]});
+      contraction.out_arcs[edge.from].push_back(arc_id);
+      contraction.in_arcs[edge.to].push_back(arc_id);
+    }
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::RunWitnessSearch(Contraction& contraction, VertexId source,
+                                                      VertexId skipped, Weight limit,
+                                                      size_t target_count) const {
+    auto& weights = contraction.witness_weights;
+    for (const VertexId vertex : contraction.witness_touched) {
+      weights[vertex].reset();
+    }
+    contraction.witness_touched.clear();
+
+    std::priority_queue<QueueItem> queue;
+    weights[source] = Weight{0};
+    contraction.witness_touched.push_back(source);
+    queue.push({*weights[source], source});
+
+    size_t settled_count = 0;
+    while (!queue.empty() && settled_count < WITNESS_SETTLE_LIMIT) {
+      const QueueItem item = queue.top();
+      queue.pop();
+      if (*weights[item.vertex] < item.weight) {
+        continue;
+      }
+      if (contraction.is_witness_target[item.vertex] && --target_count == 0) {
+        break;
+      }
+      ++settled_count;
+      for (const ArcId arc_id : contraction.out_arcs[item.vertex]) {
+        const Arc& arc = arcs_[arc_id];
+        const Weight candidate_weight = item.weight + arc.weight;
+        if (arc.to == skipped || limit < candidate_weight) {
+          continue;
+        }
+        auto& weight = weights[arc.to];
+        if (!weight || candidate_weight < *weight) {
+          if (!weight) {
+            contraction.witness_touched.push_back(arc.to);
+          }
+          weight = candidate_weight;
+          queue.push({candidate_weight, arc.to});
+        }
+      }
+    }
+  }
+
+  template <typename Weight>
+  std::vector<typename ContractionHierarchy<Weight>::Shortcut>
+  ContractionHierarchy<Weight>::FindShortcuts(Contraction& contraction, VertexId vertex) const {
+    std::vector<Shortcut> shortcuts;
+
+    for (const ArcId in_arc_id : contraction.in_arcs[vertex]) {
+      const Arc& in_arc = arcs_[in_arc_id];
+      std::optional<Weight> limit;
+      size_t target_count = 0;
+      for (const ArcId out_arc_id : contraction.out_arcs[vertex]) {
+        const Arc& out_arc = arcs_[out_arc_id];
+        if (out_arc.to == in_arc.from) {
+          continue;
+        }
+        const Weight via_weight = in_arc.weight + out_arc.weight;
+        if (!limit || *limit < via_weight) {
+          limit = via_weight;
+        }
+        contraction.is_witness_target[out_arc.to] = true;
+        ++target_count;
+      }
+      if (!limit) {
+        continue;
+      }
+
+      RunWitnessSearch(contraction, in_arc.from, vertex, *limit, target_count);
+      for (const ArcId out_arc_id : contraction.out_arcs[vertex]) {
+        const Arc& out_arc = arcs_[out_arc_id];
+        if (out_arc.to == in_arc.from) {
+          continue;
+        }
+        contraction.is_witness_target[out_arc.to] = false;
+        const Weight via_weight = in_arc.weight + out_arc.weight;
+        const auto& witness_weight = contraction.witness_weights[out_arc.to];
+        if (!witness_weight || via_weight < *witness_weight) {
+          shortcuts.push_back({in_arc_id, out_arc_id});
+        }
+      }
+    }
+
+    return shortcuts;
+  }
+
+  template <typename Weight>
+  int ContractionHierarchy<Weight>::ComputePriority(const Contraction& contraction, VertexId vertex,
+                                                     const std::vector<Shortcut>& shortcuts) const {
+    // Edge difference plus the number of already contracted neighbours, which spreads
+    // contraction evenly over the graph
+    const int removed_arc_count = static_cast<int>(
+        contraction.in_arcs[vertex].size() + contraction.out_arcs[vertex].size()
+    );
+    return static_cast<int>(shortcuts.size()) - removed_arc_count + contraction.contracted_neighbours[vertex];
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::AddShortcut(Contraction& contraction, const Shortcut& shortcut) {
+    const VertexId from = arcs_[shortcut.first_half].from;
+    const VertexId to = arcs_[shortcut.second_half].to;
+    const Weight weight = arcs_[shortcut.first_half].weight + arcs_[shortcut.second_half].weight;
+
+    auto& out_arcs = contraction.out_arcs[from];
+    auto& in_arcs = contraction.in_arcs[to];
+    const auto existing_it = std::find_if(out_arcs.begin(), out_arcs.end(), [this, to](ArcId arc_id) {
+      return arcs_[arc_id].to == to;
+    });
+    if (existing_it != out_arcs.end() && !(weight < arcs_[*existing_it].weight)) {
+      return;
+    }
+
+    const ArcId arc_id = arcs_.size();
+    arcs_.push_back({from, to, weight, 0, shortcut.first_half, shortcut.second_half});
+    ++shortcut_count_;
+
+    if (existing_it != out_arcs.end()) {
+      const ArcId replaced_id = *existing_it;
+      *existing_it = arc_id;
+      *std::find(in_arcs.begin(), in_arcs.end(), replaced_id) = arc_id;
+    } else {
+      out_arcs.push_back(arc_id);
+      in_arcs.push_back(arc_id);
+    }
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::Contract(Contraction& contraction) {
+    const size_t vertex_count = rank_.size();
+
+    using PriorityItem = std::pair<int, VertexId>;
+    std::priority_queue<PriorityItem, std::vector<PriorityItem>, std::greater<>> queue;
+    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+      queue.push({ComputePriority(contraction, vertex, FindShortcuts(contraction, vertex)), vertex});
+    }
+
+    size_t next_rank = 0;
+    while (!queue.empty()) {
+      const VertexId vertex = queue.top().second;
+      queue.pop();
+
+      // Priorities go stale as neighbours get contracted, so re-evaluate lazily
+      const std::vector<Shortcut> shortcuts = FindShortcuts(contraction, vertex);
+      const int priority = ComputePriority(contraction, vertex, shortcuts);
+      if (!queue.empty() && priority > queue.top().first) {
+        queue.push({priority, vertex});
+        continue;
+      }
+
+      for (const Shortcut& shortcut : shortcuts) {
+        AddShortcut(contraction, shortcut);
+      }
+
+      rank_[vertex] = next_rank++;
+      DetachVertex(contraction, vertex);
+    }
+
+    for (auto& arc_ids : upward_out_) {
+      arc_ids.shrink_to_fit();
+    }
+    for (auto& arc_ids : upward_in_) {
+      arc_ids.shrink_to_fit();
+    }
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::DetachVertex(Contraction& contraction, VertexId vertex) {
+    auto erase_arc = [](std::vector<ArcId>& arc_ids, ArcId arc_id) {
+      const auto it = std::find(arc_ids.begin(), arc_ids.end(), arc_id);
+      *it = arc_ids.back();
+      arc_ids.pop_back();
+    };
+
+    // Every neighbour still in the graph gets contracted later, i.e. ranks higher
+    for (const ArcId arc_id : contraction.in_arcs[vertex]) {
+      const VertexId neighbour = arcs_[arc_id].from;
+      upward_in_[vertex].push_back(arc_id);
+      erase_arc(contraction.out_arcs[neighbour], arc_id);
+      ++contraction.contracted_neighbours[neighbour];
+    }
+    for (const ArcId arc_id : contraction.out_arcs[vertex]) {
+      const VertexId neighbour = arcs_[arc_id].to;
+      upward_out_[vertex].push_back(arc_id);
+      erase_arc(contraction.in_arcs[neighbour], arc_id);
+      ++contraction.contracted_neighbours[neighbour];
+    }
+    contraction.in_arcs[vertex] = {};
+    contraction.out_arcs[vertex] = {};
+  }
+
+  template <typename Weight>
+  size_t ContractionHierarchy<Weight>::GetShortcutCount() const {
+    return shortcut_count_;
+  }
+
+  template <typename Weight>
+  template <typename Writer>
+  void ContractionHierarchy<Weight>::Save(Writer& writer) const {
+    writer.WriteArray(arcs_);
+    writer.WriteArray(rank_);
+    writer.Write(static_cast<uint64_t>(shortcut_count_));
+    writer.Write(static_cast<uint64_t>(upward_out_.size()));
+    for (VertexId vertex = 0; vertex < upward_out_.size(); ++vertex) {
+      writer.WriteArray(upward_out_[vertex]);
+      writer.WriteArray(upward_in_[vertex]);
+    }
+  }
+
+  template <typename Weight>
+  template <typename Reader>
+  ContractionHierarchy<Weight> ContractionHierarchy<Weight>::Load(Reader& reader) {
+    ContractionHierarchy hierarchy;
+    hierarchy.arcs_ = reader.template ReadArray<Arc>();
+    hierarchy.rank_ = reader.template ReadArray<size_t>();
+    hierarchy.shortcut_count_ = reader.template Read<uint64_t>();
+    const size_t vertex_count = reader.template Read<uint64_t>();
+    hierarchy.upward_out_.resize(vertex_count);
+    hierarchy.upward_in_.resize(vertex_count);
+    for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+      hierarchy.upward_out_[vertex] = reader.template ReadArray<ArcId>();
+      hierarchy.upward_in_[vertex] = reader.template ReadArray<ArcId>();
+    }
+    return hierarchy;
+  }
+
+  template <typename Weight>
+  void ContractionHierarchy<Weight>::UnpackArc(ArcId arc_id, std::vector<EdgeId>& edges) const {
+    std::vector<ArcId> stack = {arc_id};
+    while (!stack.empty()) {
+      const Arc& arc = arcs_[stack.back()];
+      stack.pop_back();
+      if (arc.IsShortcut()) {
+        stack.push_back(arc.second_half);
+        stack.push_back(arc.first_half);
+      } else {
+        edges.push_back(arc.original_edge);
+      }
+    }
+  }
+
+  template <typename Weight>
+  std::optional<Weight> ContractionHierarchy<Weight>::FindRoute(VertexId from, VertexId to,
+                                                                std::vector<EdgeId>& edges) const {
+    static thread_local SearchSpace forward_space;
+    static thread_local SearchSpace backward_space;
+    const size_t vertex_count = rank_.size();
+    forward_space.Reset(vertex_count);
+    backward_space.Reset(vertex_count);
+
+    std::priority_queue<QueueItem> forward_queue;
+    std::priority_queue<QueueItem> backward_queue;
+    forward_space.weights[from] = Weight{0};
+    forward_space.parent_arcs[from] = NO_ARC;
+    forward_space.touched.push_back(from);
+    forward_queue.push({Weight{0}, from});
+    backward_space.weights[to] = Weight{0};
+    backward_space.parent_arcs[to] = NO_ARC;
+    backward_space.touched.push_back(to);
+    backward_queue.push({Weight{0}, to});
+
+    std::optional<Weight> best_weight;
+    VertexId meeting_vertex = from;
+
+    auto step = [this, &best_weight, &meeting_vertex](std::priority_queue<QueueItem>& queue, SearchSpace& space,
+                                                      const SearchSpace& other_space,
+                                                      const std::vector<std::vector<ArcId>>& arcs, bool forward) {
+      const QueueItem item = queue.top();
+      queue.pop();
+      if (*space.weights[item.vertex] < item.weight) {
+        return;
+      }
+      if (const auto& other_weight = other_space.weights[item.vertex]) {
+        const Weight candidate_weight = item.weight + *other_weight;
+        if (!best_weight || candidate_weight < *best_weight) {
+          best_weight = candidate_weight;
+          meeting_vertex = item.vertex;
+        }
+      }
+      for (const ArcId arc_id : arcs[item.vertex]) {
+        const Arc& arc = arcs_[arc_id];
+        const VertexId next_vertex = forward ? arc.to : arc.from;
+        const Weight candidate_weight = item.weight + arc.weight;
+        auto& weight = space.weights[next_vertex];
+        if (!weight || candidate_weight < *weight) {
+          if (!weight) {
+            space.touched.push_back(next_vertex);
+          }
+          weight = candidate_weight;
+          space.parent_arcs[next_vertex] = arc_id;
+          queue.push({candidate_weight, next_vertex});
+        }
+      }
+    };
+
+    auto is_exhausted = [&best_weight](const std::priority_queue<QueueItem>& queue) {
+      return queue.empty() || (best_weight && !(queue.top().weight < *best_weight));
+    };
+
+    while (!is_exhausted(forward_queue) || !is_exhausted(backward_queue)) {
+      if (!is_exhausted(forward_queue)) {
+        step(forward_queue, forward_space, backward_space, upward_out_, true);
+      }
+      if (!is_exhausted(backward_queue)) {
+        step(backward_queue, backward_space, forward_space, upward_in_, false);
+      }
+    }
+
+    if (!best_weight) {
+      return std::nullopt;
+    }
+
+    std::vector<ArcId> forward_arcs;
+    for (VertexId vertex = meeting_vertex; forward_space.parent_arcs[vertex] != NO_ARC;) {
+      const ArcId arc_id = forward_space.parent_arcs[vertex];
+      forward_arcs.push_back(arc_id);
+      vertex = arcs_[arc_id].from;
+    }
+    for (auto it = forward_arcs.rbegin(); it != forward_arcs.rend(); ++it) {
+      UnpackArc(*it, edges);
+    }
+    for (VertexId vertex = meeting_vertex; backward_space.parent_arcs[vertex] != NO_ARC;) {
+      const ArcId arc_id = backward_space.parent_arcs[vertex];
+      UnpackArc(arc_id, edges);
+      vertex = arcs_[arc_id].to;
+    }
+    return best_weight;
+  }
+
+}
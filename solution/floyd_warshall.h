@@ -0,0 +1,230 @@
+#pragma once
+
+#include "graph.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <new>
+#include <optional>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace Graph {
+
+  template <typename T, size_t Alignment>
+  struct AlignedAllocator {
+    using value_type = T;
+
+    template <typename U>
+    struct rebind {
+      using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T* allocate(size_t count) {
+      return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t(Alignment)));
+    }
+
+    void deallocate(T* ptr, size_t) {
+      ::operator delete(ptr, std::align_val_t(Alignment));
+    }
+
+    template <typename U>
+    bool operator == (const AlignedAllocator<U, Alignment>&) const {
+      return true;
+    }
+
+    template <typename U>
+    bool operator != (const AlignedAllocator<U, Alignment>&) const {
+      return false;
+    }
+  };
+
+  // All-pairs shortest paths kept as two flat row-major matrices: route weights, +inf for
+  // unreachable pairs, and the last edge of every route. Rows are padded to whole tiles and
+  // the closure is computed by blocked Floyd-Warshall: for every diagonal tile in turn,
+  // first the diagonal tile itself, then its row and column, then all the remaining tiles
+  // are relaxed through it. Tiles of the last two phases are independent of each other
+  // and are spread over threads.
+  template <typename Weight>
+  class FloydWarshall {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    explicit FloydWarshall(const Graph& graph, size_t thread_count = 1);
+
+    std::optional<Weight> FindRouteWeight(VertexId from, VertexId to) const;
+
+    // graph must be the one the matrices were built for
+    std::optional<Weight> FindRoute(const Graph& graph, VertexId from, VertexId to,
+                                    std::vector<EdgeId>& edges) const;
+
+    template <typename Writer>
+    void Save(Writer& writer) const;
+    template <typename Reader>
+    static FloydWarshall Load(Reader& reader);
+
+  private:
+    FloydWarshall() = default;
+
+    static constexpr size_t TILE = 64;
+    static constexpr size_t ALIGNMENT = 64;
+    static constexpr double NO_ROUTE = std::numeric_limits<double>::infinity();
+    static constexpr uint32_t NO_EDGE = std::numeric_limits<uint32_t>::max();
+
+    void RelaxTile(size_t row_tile, size_t column_tile, size_t via_tile);
+
+    static void RelaxRow(double to_via, const double* via_weights, const uint32_t* via_edges,
+                         double* weights, uint32_t* edges);
+
+    size_t vertex_count_ = 0;
+    size_t stride_ = 0;
+    std::vector<double, AlignedAllocator<double, ALIGNMENT>> weights_;
+    std::vector<uint32_t, AlignedAllocator<uint32_t, ALIGNMENT>> last_edges_;
+  };
+
+
+  template <typename Weight>
+  FloydWarshall<Weight>::FloydWarshall(const Graph& graph, size_t thread_count)
+      : vertex_count_(graph.GetVertexCount()),
+        stride_((vertex_count_ + TILE - 1) / TILE * TILE),
+        weights_(stride_ * stride_, NO_ROUTE),
+        last_edges_(stride_ * stride_, NO_EDGE)
+  {
+    assert(graph.GetEdgeCount() < NO_EDGE);
+    for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+      double* weights = &weights_[vertex * stride_];
+      uint32_t* last_edges = &last_edges_[vertex * stride_];
+      weights[vertex] = 0;
+      graph.ForEachIncidentEdge(vertex, [&](EdgeId edge_id, VertexId edge_to, const Weight& edge_weight) {
+        assert(edge_weight >= 0);
+        if (static_cast<double>(edge_weight) < weights[edge_to]) {
+          weights[edge_to] = static_cast<double>(edge_weight);
+          last_edges[edge_to] = edge_id;
+        }
+      });
+    }
+
+    const size_t tile_count = stride_ / TILE;
+    for (size_t via_tile = 0; via_tile < tile_count; ++via_tile) {
+      RelaxTile(via_tile, via_tile, via_tile);
+      RunConcurrently(tile_count, thread_count, [&](size_t tile) {
+        if (tile != via_tile) {
+          RelaxTile(via_tile, tile, via_tile);
+          RelaxTile(tile, via_tile, via_tile);
+        }
+      });
+      RunConcurrently(tile_count * tile_count, thread_count, [&](size_t tile_idx) {
+        const size_t row_tile = tile_idx / tile_count;
+        const size_t column_tile = tile_idx % tile_count;
+        if (row_tile != via_tile && column_tile != via_tile) {
+          RelaxTile(row_tile, column_tile, via_tile);
+        }
+      });
+    }
+  }
+
+  template <typename Weight>
+  void FloydWarshall<Weight>::RelaxTile(size_t row_tile, size_t column_tile, size_t via_tile) {
+    const size_t row_begin = row_tile * TILE;
+    const size_t column_begin = column_tile * TILE;
+    const size_t via_begin = via_tile * TILE;
+    for (size_t via = via_begin; via < via_begin + TILE; ++via) {
+      const size_t via_offset = via * stride_ + column_begin;
+      for (size_t row = row_begin; row < row_begin + TILE; ++row) {
+        const double to_via = weights_[row * stride_ + via];
+        if (to_via == NO_ROUTE) {
+          continue;
+        }
+        const size_t row_offset = row * stride_ + column_begin;
+        RelaxRow(to_via, &weights_[via_offset], &last_edges_[via_offset],
+                 &weights_[row_offset], &last_edges_[row_offset]);
+      }
+    }
+  }
+
+  template <typename Weight>
+  void FloydWarshall<Weight>::RelaxRow(double to_via, const double* via_weights, const uint32_t* via_edges,
+                                       double* weights, uint32_t* edges) {
+#ifdef __AVX2__
+    // Four routes per step; the 64-bit comparison mask is narrowed to the 32-bit edge lanes
+    const __m256d through = _mm256_set1_pd(to_via);
+    const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+    for (size_t column = 0; column < TILE; column += 4) {
+      const __m256d candidate = _mm256_add_pd(through, _mm256_load_pd(via_weights + column));
+      const __m256d current = _mm256_load_pd(weights + column);
+      const __m256d is_better = _mm256_cmp_pd(candidate, current, _CMP_LT_OQ);
+      _mm256_store_pd(weights + column, _mm256_blendv_pd(current, candidate, is_better));
+
+      const __m128i edge_mask = _mm256_castsi256_si128(
+          _mm256_permutevar8x32_epi32(_mm256_castpd_si256(is_better), low_halves));
+      auto* edge_lanes = reinterpret_cast<__m128i*>(edges + column);
+      const auto* via_edge_lanes = reinterpret_cast<const __m128i*>(via_edges + column);
+      _mm_store_si128(edge_lanes, _mm_blendv_epi8(_mm_load_si128(edge_lanes), _mm_load_si128(via_edge_lanes), edge_mask));
+    }
+#else
+    for (size_t column = 0; column < TILE; ++column) {
+      const double candidate = to_via + via_weights[column];
+      const bool is_better = candidate < weights[column];
+      weights[column] = is_better ? candidate : weights[column];
+      edges[column] = is_better ? via_edges[column] : edges[column];
+    }
+#endif
+  }
+
+  template <typename Weight>
+  std::optional<Weight> FloydWarshall<Weight>::FindRouteWeight(VertexId from, VertexId to) const {
+    const double weight = weights_[from * stride_ + to];
+    if (weight == NO_ROUTE) {
+      return std::nullopt;
+    }
+    return Weight(weight);
+  }
+
+  template <typename Weight>
+  std::optional<Weight> FloydWarshall<Weight>::FindRoute(const Graph& graph, VertexId from, VertexId to,
+                                                         std::vector<EdgeId>& edges) const {
+    const size_t row_offset = from * stride_;
+    if (weights_[row_offset + to] == NO_ROUTE) {
+      return std::nullopt;
+    }
+    for (uint32_t edge_id = last_edges_[row_offset + to];
+         edge_id != NO_EDGE;
+         edge_id = last_edges_[row_offset + graph.GetEdge(edge_id).from]) {
+      edges.push_back(edge_id);
+    }
+    std::reverse(std::begin(edges), std::end(edges));
+    return Weight(weights_[row_offset + to]);
+  }
+
+  template <typename Weight>
+  template <typename Writer>
+  void FloydWarshall<Weight>::Save(Writer& writer) const {
+    writer.Write(static_cast<uint64_t>(vertex_count_));
+    writer.Write(static_cast<uint64_t>(stride_));
+    writer.WriteArray(weights_);
+    writer.WriteArray(last_edges_);
+  }
+
+  template <typename Weight>
+  template <typename Reader>
+  FloydWarshall<Weight> FloydWarshall<Weight>::Load(Reader& reader) {
+    FloydWarshall matrices;
+    matrices.vertex_count_ = reader.template Read<uint64_t>();
+    matrices.stride_ = reader.template Read<uint64_t>();
+    matrices.weights_ = reader.template ReadArray<double, AlignedAllocator<double, ALIGNMENT>>();
+    matrices.last_edges_ = reader.template ReadArray<uint32_t, AlignedAllocator<uint32_t, ALIGNMENT>>();
+    return matrices;
+  }
+}
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <cstdlib>
 #include <deque>
 #include <vector>
@@ -30,41 +33,171 @@ namespace Graph {
     Weight weight;
   };
 
+  // The graph is built through per-vertex incidence lists. Finalize() freezes it into
+  // compressed sparse row form: edges sorted by source, with offsets_[v]..offsets_[v + 1]
+  // indexing contiguous arrays of edge ids, targets and weights. Adding an edge to
+  // a finalized graph thaws it back into incidence lists.
   template <typename Weight>
   class DirectedWeightedGraph {
   private:
     using IncidenceList = std::vector<EdgeId>;
-    using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
+    using IncidentEdgesRange = Range<const EdgeId*>;
 
   public:
     DirectedWeightedGraph(size_t vertex_count);
     EdgeId AddEdge(const Edge<Weight>& edge);
+    void ReserveEdges(size_t edge_count);
+    // Appends isolated vertices and returns the id of the first one
+    VertexId AddVertices(size_t count);
+    // Unlinks the edges from the graph; their ids stay allocated and are never reused
+    void RemoveEdges(const std::vector<EdgeId>& edge_ids);
+    void Finalize();
 
+    bool IsFinalized() const;
     size_t GetVertexCount() const;
     size_t GetEdgeCount() const;
     const Edge<Weight>& GetEdge(EdgeId edge_id) const;
     IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
+    // Calls callback(edge_id, to, weight) for every edge leaving the vertex
+    template <typename Callback>
+    void ForEachIncidentEdge(VertexId vertex, Callback callback) const;
+
+    // Stores the finalized graph through a Snapshot::Writer-like archive; Load() restores
+    // it already in CSR form
+    template <typename Writer>
+    void Save(Writer& writer) const;
+    template <typename Reader>
+    static DirectedWeightedGraph Load(Reader& reader);
+
   private:
+    void Thaw();
+
+    size_t vertex_count_;
     std::vector<Edge<Weight>> edges_;
     std::vector<IncidenceList> incidence_lists_;
+
+    bool is_finalized_ = false;
+    std::vector<size_t> offsets_;
+    std::vector<EdgeId> csr_edge_ids_;
+    std::vector<VertexId> csr_targets_;
+    std::vector<Weight> csr_weights_;
   };
 
 
   template <typename Weight>
-  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+  DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count)
+      : vertex_count_(vertex_count),
+        incidence_lists_(vertex_count) {}
 
   template <typename Weight>
   EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
+    if (is_finalized_) {
+      Thaw();
+    }
     edges_.push_back(edge);
     const EdgeId id = edges_.size() - 1;
     incidence_lists_[edge.from].push_back(id);
     return id;
   }
 
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::ReserveEdges(size_t edge_count) {
+    edges_.reserve(edge_count);
+  }
+
+  template <typename Weight>
+  VertexId DirectedWeightedGraph<Weight>::AddVertices(size_t count) {
+    const VertexId first_vertex = vertex_count_;
+    vertex_count_ += count;
+    if (is_finalized_) {
+      offsets_.resize(vertex_count_ + 1, offsets_.back());
+    } else {
+      incidence_lists_.resize(vertex_count_);
+    }
+    return first_vertex;
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::RemoveEdges(const std::vector<EdgeId>& edge_ids) {
+    if (edge_ids.empty()) {
+      return;
+    }
+    if (is_finalized_) {
+      Thaw();
+    }
+    std::vector<bool> is_removed(edges_.size(), false);
+    std::vector<VertexId> sources;
+    for (const EdgeId edge_id : edge_ids) {
+      is_removed[edge_id] = true;
+      sources.push_back(edges_[edge_id].from);
+    }
+    std::sort(sources.begin(), sources.end());
+    sources.erase(std::unique(sources.begin(), sources.end()), sources.end());
+    for (const VertexId vertex : sources) {
+      auto& incidence_list = incidence_lists_[vertex];
+      incidence_list.erase(
+          std::remove_if(incidence_list.begin(), incidence_list.end(),
+                         [&is_removed](EdgeId edge_id) { return is_removed[edge_id]; }),
+          incidence_list.end()
+      );
+    }
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::Finalize() {
+    if (is_finalized_) {
+      return;
+    }
+
+    offsets_.assign(vertex_count_ + 1, 0);
+    for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+      offsets_[vertex + 1] = offsets_[vertex] + incidence_lists_[vertex].size();
+    }
+
+    const size_t edge_count = offsets_.back();
+    csr_edge_ids_.resize(edge_count);
+    csr_targets_.resize(edge_count);
+    csr_weights_.resize(edge_count);
+    for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+      size_t slot = offsets_[vertex];
+      for (const EdgeId edge_id : incidence_lists_[vertex]) {
+        csr_edge_ids_[slot] = edge_id;
+        csr_targets_[slot] = edges_[edge_id].to;
+        csr_weights_[slot] = edges_[edge_id].weight;
+        ++slot;
+      }
+    }
+
+    incidence_lists_ = {};
+    is_finalized_ = true;
+  }
+
+  template <typename Weight>
+  void DirectedWeightedGraph<Weight>::Thaw() {
+    incidence_lists_.resize(vertex_count_);
+    for (VertexId vertex = 0; vertex < vertex_count_; ++vertex) {
+      incidence_lists_[vertex].assign(
+          csr_edge_ids_.begin() + offsets_[vertex],
+          csr_edge_ids_.begin() + offsets_[vertex + 1]
+      );
+    }
+
+    offsets_ = {};
+    csr_edge_ids_ = {};
+    csr_targets_ = {};
+    csr_weights_ = {};
+    is_finalized_ = false;
+  }
+
+  template <typename Weight>
+  bool DirectedWeightedGraph<Weight>::IsFinalized() const {
+    return is_finalized_;
+  }
+
   template <typename Weight>
   size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
-    return incidence_lists_.size();
+    return vertex_count_;
   }
 
   template <typename Weight>
@@ -80,7 +213,52 @@ namespace Graph {
   template <typename Weight>
   typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
   DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
+    if (is_finalized_) {
+      const EdgeId* edges = csr_edge_ids_.data();
+      return {edges + offsets_[vertex], edges + offsets_[vertex + 1]};
+    }
     const auto& edges = incidence_lists_[vertex];
-    return {std::begin(edges), std::end(edges)};
+    return {edges.data(), edges.data() + edges.size()};
+  }
+
+  template <typename Weight>
+  template <typename Callback>
+  void DirectedWeightedGraph<Weight>::ForEachIncidentEdge(VertexId vertex, Callback callback) const {
+    if (is_finalized_) {
+      for (size_t slot = offsets_[vertex]; slot < offsets_[vertex + 1]; ++slot) {
+        callback(csr_edge_ids_[slot], csr_targets_[slot], csr_weights_[slot]);
+      }
+      return;
+    }
+    for (const EdgeId edge_id : incidence_lists_[vertex]) {
+      const auto& edge = edges_[edge_id];
+      callback(edge_id, edge.to, edge.weight);
+    }
+  }
+
+  template <typename Weight>
+  template <typename Writer>
+  void DirectedWeightedGraph<Weight>::Save(Writer& writer) const {
+    assert(is_finalized_);
+    writer.Write(static_cast<uint64_t>(vertex_count_));
+    writer.WriteArray(edges_);
+    writer.WriteArray(offsets_);
+    writer.WriteArray(csr_edge_ids_);
+    writer.WriteArray(csr_targets_);
+    writer.WriteArray(csr_weights_);
+  }
+
+  template <typename Weight>
+  template <typename Reader>
+  DirectedWeightedGraph<Weight> DirectedWeightedGraph<Weight>::Load(Reader& reader) {
+    DirectedWeightedGraph graph(0);
+    graph.vertex_count_ = reader.template Read<uint64_t>();
+    graph.edges_ = reader.template ReadArray<Edge<Weight>>();
+    graph.offsets_ = reader.template ReadArray<size_t>();
+    graph.csr_edge_ids_ = reader.template ReadArray<EdgeId>();
+    graph.csr_targets_ = reader.template ReadArray<VertexId>();
+    graph.csr_weights_ = reader.template ReadArray<Weight>();
+    graph.is_finalized_ = true;
+    return graph;
   }
 }
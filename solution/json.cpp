@@ -1,6 +1,17 @@
 #include "json.h"
 
+#include <algorithm>
+#include <charconv>
+#include <cstring>
 #include <iomanip>
+#include <iterator>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -9,115 +20,216 @@ namespace Json {
   const std::vector<Node>& Node::AsArray() const {
     return std::get<std::vector<Node>>(*this);
   }
-  const std::map<std::string, Node>& Node::AsMap() const {
-    return std::get<std::map<std::string, Node>>(*this);
+  const Dict& Node::AsMap() const {
+    return std::get<Dict>(*this);
   }
   int32_t Node::AsInt() const {
     return std::get<int32_t>(*this);
   }
   double Node::AsDouble() const {
+    if (const auto* value = std::get_if<int32_t>(this)) {
+      return *value;
+    }
     return std::get<double>(*this);
   }
   bool Node::AsBool() const {
     return std::get<bool>(*this);
   }
-  const std::string& Node::AsString() const {
-    return std::get<std::string>(*this);
+  std::string_view Node::AsString() const {
+    return std::get<std::string_view>(*this);
   }
 
   Document::Document(Node root) : root(move(root)) {
   }
 
+  Document::Document(Node root, shared_ptr<const char> buffer) : buffer(move(buffer)), root(move(root)) {
+  }
+
   const Node& Document::GetRoot() const {
     return root;
   }
 
-  Node LoadNode(istream& input);
+  bool IsNumberChar(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E';
+  }
 
-  Node LoadArray(istream& input) {
-    vector<Node> result;
+  // Integer literals that fit into int32_t become ints, everything else
+  // (fractions, exponents, out of range values) becomes a correctly rounded double
+  Node ParseNumber(const char* begin, const char* end) {
+    const bool is_integer = find_if(begin, end, [](char c) {
+      return c == '.' || c == 'e' || c == 'E';
+    }) == end;
+    if (*begin == '+') {
+      ++begin;
+    }
 
-    for (char c; input >> c && c != ']'; ) {
-      if (c != ',') {
-        input.putback(c);
+    if (is_integer) {
+      int32_t result = 0;
+      if (const auto [ptr, error] = from_chars(begin, end, result); error == errc() && ptr == end) {
+        return Node(result);
       }
-      result.push_back(LoadNode(input));
     }
 
-    return Node(move(result));
-  }
-
-  Node LoadInt(istream& input) {
-    int32_t result = 0;
-    while (isdigit(input.peek())) {
-      result *= 10;
-      result += input.get() - '0';
-    }
-    return Node(result);
-  }
-  
-  Node LoadDouble(istream& input) {
     double result = 0.0;
-    input >> result;
-    return Node(result);
-  }
-  
-  Node LoadBool(istream& input) {
-    bool result = false;
-    input >> boolalpha >> result;
+    if (const auto [ptr, error] = from_chars(begin, end, result); error != errc() || ptr != end) {
+      throw invalid_argument("Invalid number in JSON input: " + string(begin, end));
+    }
     return Node(result);
   }
 
-  Node LoadString(istream& input) {
-    string line;
-    getline(input, line, '"');
-    return Node(move(line));
-  }
+  class BufferParser {
+  public:
+    explicit BufferParser(string_view input) : pos_(input.data()), end_(input.data() + input.size()) {}
+
+    Node LoadNode() {
+      const char c = Next();
+
+      if (c == '[') {
+        return LoadArray();
+      } else if (c == '{') {
+        return LoadDict();
+      } else if (c == '"') {
+        return LoadString();
+      } else if (c == 't' || c == 'f') {
+        --pos_;
+        return LoadBool();
+      } else {
+        --pos_;
+        return LoadNumber();
+      }
+    }
+
+  private:
+    void SkipSpaces() {
+      while (pos_ != end_ && (*pos_ == ' ' || *pos_ == '\n' || *pos_ == '\t' || *pos_ == '\r')) {
+        ++pos_;
+      }
+    }
+
+    char Next() {
+      SkipSpaces();
+      if (pos_ == end_) {
+        throw invalid_argument("Unexpected end of JSON input");
+      }
+      return *pos_++;
+    }
 
-  Node LoadDict(istream& input) {
-    map<string, Node> result;
+    Node LoadArray() {
+      vector<Node> result;
 
-    for (char c; input >> c && c != '}'; ) {
-      if (c == ',') {
-        input >> c;
+      for (char c; (c = Next()) != ']'; ) {
+        if (c != ',') {
+          --pos_;
+        }
+        result.push_back(LoadNode());
       }
 
-      string key = LoadString(input).AsString();
-      input >> c;
-      Node node = 0;
-      if (key == "latitude"s || key == "longitude"s || key == "bus_velocity"s) {
-        node = LoadDouble(input);
+      return Node(move(result));
+    }
+
+    Node LoadNumber() {
+      const char* begin = pos_;
+      while (pos_ != end_ && IsNumberChar(*pos_)) {
+        ++pos_;
       }
-      else {
-        node = LoadNode(input);
+      if (begin == pos_) {
+        throw invalid_argument("Unexpected character in JSON input");
       }
-      result.emplace(move(key), std::move(node));
+      return ParseNumber(begin, pos_);
     }
 
-    return Node(move(result));
-  }
+    Node LoadBool() {
+      if (end_ - pos_ >= 4 && memcmp(pos_, "true", 4) == 0) {
+        pos_ += 4;
+        return Node(true);
+      }
+      if (end_ - pos_ >= 5 && memcmp(pos_, "false", 5) == 0) {
+        pos_ += 5;
+        return Node(false);
+      }
+      throw invalid_argument("Boolean expected in JSON input");
+    }
 
-  Node LoadNode(istream& input) {
-    char c;
-    input >> c;
+    string_view ReadString() {
+      const char* quote = static_cast<const char*>(memchr(pos_, '"', end_ - pos_));
+      if (!quote) {
+        throw invalid_argument("Unterminated string in JSON input");
+      }
+      const string_view result(pos_, quote - pos_);
+      pos_ = quote + 1;
+      return result;
+    }
 
-    if (c == '[') {
-      return LoadArray(input);
-    } else if (c == '{') {
-      return LoadDict(input);
-    } else if (c == '"') {
-      return LoadString(input);
-    } else if (c == 't' || c == 'f') {
-      input.putback(c);
-      return LoadBool(input);
-    } else {
-      input.putback(c);
-      return LoadInt(input);
+    Node LoadString() {
+      return Node(ReadString());
     }
+
+    Node LoadDict() {
+      Dict result;
+
+      for (char c; (c = Next()) != '}'; ) {
+        if (c == ',') {
+          Next();
+        }
+
+        const string_view key = ReadString();
+        Next();
+        result.emplace(key, LoadNode());
+      }
+
+      return Node(move(result));
+    }
+
+    const char* pos_;
+    const char* end_;
+  };
+
+  Document Load(string_view input) {
+    return Document{BufferParser(input).LoadNode()};
+  }
+
+  // The string is held through the aliasing shared_ptr, so the views stay valid
+  // however the document is moved
+  Document LoadOwned(string content) {
+    const auto owner = make_shared<const string>(move(content));
+    Node root = BufferParser(*owner).LoadNode();
+    return Document(move(root), shared_ptr<const char>(owner, owner->data()));
   }
 
   Document Load(istream& input) {
-    return Document{LoadNode(input)};
+    return LoadOwned(string(istreambuf_iterator<char>(input), istreambuf_iterator<char>()));
+  }
+
+  Document LoadFile(const string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw runtime_error("Cannot open " + path);
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size > 0) {
+      const size_t size = file_stat.st_size;
+      void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (data == MAP_FAILED) {
+        throw runtime_error("Cannot map " + path);
+      }
+      madvise(data, size, MADV_SEQUENTIAL);
+      // Unmapped when the document and its copies are gone, or right away on a parse error
+      shared_ptr<const char> mapping(static_cast<const char*>(data), [size](const char* bytes) {
+        munmap(const_cast<char*>(bytes), size);
+      });
+      Node root = BufferParser(string_view(mapping.get(), size)).LoadNode();
+      return Document(move(root), move(mapping));
+    }
+
+    string content;
+    char chunk[1 << 16];
+    for (ssize_t read_count; (read_count = read(fd, chunk, sizeof(chunk))) > 0; ) {
+      content.append(chunk, read_count);
+    }
+    close(fd);
+    return LoadOwned(move(content));
   }
 
   ostream& PrintNode(ostream& output, const Node& node, size_t tab_count = 0, bool first_tabs = true);
@@ -132,7 +244,7 @@ namespace Json {
     }
   }
 
-  void PrintString(ostream& output, const string& node, size_t tab_count, bool first_tabs = true) {
+  void PrintString(ostream& output, string_view node, size_t tab_count, bool first_tabs = true) {
     if (first_tabs) {
       PrintTabs(output, tab_count);
     }
@@ -163,7 +275,7 @@ namespace Json {
     output << ']';
   }
   
-  void PrintMap(ostream& output, const map<string, Node>& node, size_t tab_count, bool first_tabs = true) {
+  void PrintMap(ostream& output, const Dict& node, size_t tab_count, bool first_tabs = true) {
     if (first_tabs) {
       PrintTabs(output, tab_count);
     }
@@ -217,7 +329,7 @@ namespace Json {
       PrintArray(output, node.AsArray(), tab_count, first_tabs);
     }
 
-    else if (holds_alternative<map<string, Node>>(node)) {
+    else if (holds_alternative<Dict>(node)) {
       PrintMap(output, node.AsMap(), tab_count, first_tabs);
     }
     
@@ -233,11 +345,238 @@ namespace Json {
       PrintBool(output, node.AsBool(), tab_count, first_tabs);
     }
     
-    else if (holds_alternative<string>(node)) {
+    else if (holds_alternative<string_view>(node)) {
       PrintString(output, node.AsString(), tab_count, first_tabs);
     }
 
     return output;
   }
 
+  Writer::Writer(FILE* output, Mode mode)
+    : output_(output),
+      mode_(mode)
+  {
+    buffer_.reserve(FLUSH_THRESHOLD + FLUSH_THRESHOLD / 2);
+  }
+
+  Writer::Writer(Mode mode, Frame frame)
+    : output_(nullptr),
+      mode_(mode),
+      frames_{frame}
+  {
+  }
+
+  Writer::Writer(Writer&& other)
+    : output_(exchange(other.output_, nullptr)),
+      mode_(other.mode_),
+      buffer_(move(other.buffer_)),
+      frames_(move(other.frames_))
+  {
+  }
+
+  Writer::~Writer() {
+    Flush();
+  }
+
+  Writer Writer::ItemWriter() const {
+    // Marked non-empty so that every item gets its separator; AppendItems() drops
+    // the leading one when the items open the array
+    return Writer(mode_, Frame{false, frames_.back().indent, false});
+  }
+
+  Writer& Writer::AppendItems(string_view items) {
+    if (items.empty()) {
+      return *this;
+    }
+    Frame& frame = frames_.back();
+    if (frame.is_empty) {
+      items.remove_prefix(1);
+    }
+    frame.is_empty = false;
+    buffer_ += items;
+    FlushIfFull();
+    return *this;
+  }
+
+  Writer Writer::ValueWriter() const {
+    return Writer(mode_, Frame{true, frames_.back().indent, false});
+  }
+
+  Writer& Writer::RawValue(string_view value) {
+    BeginValue();
+    buffer_ += value;
+    FlushIfFull();
+    return *this;
+  }
+
+  string Writer::ExtractBuffer() {
+    return move(buffer_);
+  }
+
+  void Writer::Flush() {
+    if (!output_) {
+      return;
+    }
+    if (!buffer_.empty()) {
+      fwrite(buffer_.data(), 1, buffer_.size(), output_);
+      buffer_.clear();
+    }
+    fflush(output_);
+  }
+
+  void Writer::FlushIfFull() {
+    if (output_ && buffer_.size() >= FLUSH_THRESHOLD) {
+      fwrite(buffer_.data(), 1, buffer_.size(), output_);
+      buffer_.clear();
+    }
+  }
+
+  void Writer::Indent(size_t indent) {
+    if (mode_ == Mode::PRETTY) {
+      buffer_ += '\n';
+      buffer_.append(indent, ' ');
+    }
+  }
+
+  // Emits the separator before a value and returns the indent of the value itself:
+  // array items sit one level deeper than their bracket, object values two
+  size_t Writer::BeginValue() {
+    if (frames_.empty()) {
+      return 0;
+    }
+    Frame& frame = frames_.back();
+    if (frame.is_object) {
+      return frame.indent + 2;
+    }
+    if (!frame.is_empty) {
+      buffer_ += ',';
+    }
+    frame.is_empty = false;
+    Indent(frame.indent + 1);
+    return frame.indent + 1;
+  }
+
+  void Writer::BeginContainer(bool is_object, char bracket) {
+    const size_t indent = BeginValue();
+    buffer_ += bracket;
+    frames_.push_back({is_object, indent, true});
+  }
+
+  void Writer::EndContainer(char bracket) {
+    const Frame& frame = frames_.back();
+    if (!frame.is_empty) {
+      Indent(frame.indent);
+    }
+    buffer_ += bracket;
+    frames_.pop_back();
+    FlushIfFull();
+  }
+
+  Writer& Writer::BeginArray() {
+    BeginContainer(false, '[');
+    return *this;
+  }
+
+  Writer& Writer::EndArray() {
+    EndContainer(']');
+    return *this;
+  }
+
+  Writer& Writer::BeginObject() {
+    BeginContainer(true, '{');
+    return *this;
+  }
+
+  Writer& Writer::EndObject() {
+    EndContainer('}');
+    return *this;
+  }
+
+  Writer& Writer::Key(string_view key) {
+    Frame& frame = frames_.back();
+    if (!frame.is_empty) {
+      buffer_ += ',';
+    }
+    frame.is_empty = false;
+    Indent(frame.indent + 1);
+    buffer_ += '"';
+    buffer_ += key;
+    buffer_ += mode_ == Mode::PRETTY ? "\": "sv : "\":"sv;
+    return *this;
+  }
+
+  Writer& Writer::Value(int32_t value) {
+    BeginValue();
+    char chars[16];
+    buffer_.append(chars, to_chars(begin(chars), end(chars), value).ptr);
+    return *this;
+  }
+
+  Writer& Writer::Value(double value) {
+    BeginValue();
+    // Same as ostream << setprecision(6), i.e. printf's %.6g
+    char chars[32];
+    buffer_.append(chars, to_chars(begin(chars), end(chars), value, chars_format::general, 6).ptr);
+    return *this;
+  }
+
+  Writer& Writer::Null() {
+    BeginValue();
+    buffer_ += "null"sv;
+    return *this;
+  }
+
+  Writer& Writer::Value(bool value) {
+    BeginValue();
+    buffer_ += value ? "true"sv : "false"sv;
+    return *this;
+  }
+
+  Writer& Writer::Value(string_view value) {
+    BeginValue();
+    buffer_ += '"';
+    buffer_ += value;
+    buffer_ += '"';
+    return *this;
+  }
+
+  Writer& Writer::Value(const char* value) {
+    return Value(string_view(value));
+  }
+
+  Writer& Writer::Value(const string& value) {
+    return Value(string_view(value));
+  }
+
+  Writer& Writer::Value(const Node& node) {
+    if (holds_alternative<vector<Node>>(node)) {
+      BeginArray();
+      for (const Node& item : node.AsArray()) {
+        Value(item);
+      }
+      EndArray();
+    }
+    else if (holds_alternative<Dict>(node)) {
+      BeginObject();
+      for (const auto& [key, value] : node.AsMap()) {
+        Key(key);
+        Value(value);
+      }
+      EndObject();
+    }
+    else if (holds_alternative<int>(node)) {
+      Value(node.AsInt());
+    }
+    else if (holds_alternative<double>(node)) {
+      Value(node.AsDouble());
+    }
+    else if (holds_alternative<bool>(node)) {
+      Value(node.AsBool());
+    }
+    else if (holds_alternative<string_view>(node)) {
+      Value(node.AsString());
+    }
+    return *this;
+  }
+
 }
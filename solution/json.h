@@ -1,41 +1,129 @@
 #pragma once
 
+#include <cstdio>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 namespace Json {
 
+  class Node;
+
+  // Keys are looked up with any string type, e.g. request_map.at("name"s)
+  using Dict = std::map<std::string_view, Node, std::less<>>;
+
+  // Strings and keys are views into the buffer the document was parsed from
   class Node : public std::variant<std::vector<Node>,
-                            std::map<std::string, Node>,
+                            Dict,
                             int32_t,
                             double,
                             bool,
-                            std::string> {
+                            std::string_view> {
   public:
     using variant::variant;
 
     const std::vector<Node>& AsArray() const;
-    const std::map<std::string, Node>& AsMap() const;
+    const Dict& AsMap() const;
     int AsInt() const;
     double AsDouble() const;
     bool AsBool() const;
-    const std::string& AsString() const;
+    std::string_view AsString() const;
   };
 
   class Document {
   public:
     explicit Document(Node root);
+    // Keeps alive the buffer that the strings and keys of root point into
+    Document(Node root, std::shared_ptr<const char> buffer);
 
     const Node& GetRoot() const;
 
   private:
+    std::shared_ptr<const char> buffer;
     Node root;
   };
 
+  // Reads the stream whole into a buffer owned by the document
   Document Load(std::istream& input);
 
+  // Single pass over an in-memory buffer, without going through a stream. The nodes
+  // point into input, which must outlive the document.
+  Document Load(std::string_view input);
+
+  // Memory-maps the file (or reads it whole when it cannot be mapped, e.g. a pipe);
+  // the document owns the mapping
+  Document LoadFile(const std::string& path);
+
   std::ostream& Print(std::ostream& output, const Document& document);
+
+  // Streams JSON straight into a large buffer that is flushed with fwrite, without
+  // building a Node tree first. PRETTY reproduces the layout of Print() byte for byte.
+  class Writer {
+  public:
+    enum class Mode {
+      PRETTY,
+      COMPACT
+    };
+
+    explicit Writer(FILE* output, Mode mode = Mode::PRETTY);
+    Writer(const Writer&) = delete;
+    Writer& operator = (const Writer&) = delete;
+    Writer(Writer&& other);
+    ~Writer();
+
+    // In-memory writer whose values continue the innermost open array of this one,
+    // e.g. to render a slice of responses on another thread. Its output is spliced
+    // back in order with AppendItems(ExtractBuffer()).
+    Writer ItemWriter() const;
+    Writer& AppendItems(std::string_view items);
+    std::string ExtractBuffer();
+
+    // In-memory writer for the value of the key just written to this one, so that the
+    // value can be rendered once and then repeated verbatim with RawValue()
+    Writer ValueWriter() const;
+    Writer& RawValue(std::string_view value);
+
+    Writer& BeginArray();
+    Writer& EndArray();
+    Writer& BeginObject();
+    Writer& EndObject();
+    Writer& Key(std::string_view key);
+
+    Writer& Value(int32_t value);
+    Writer& Value(double value);
+    Writer& Value(bool value);
+    Writer& Value(std::string_view value);
+    Writer& Value(const char* value);
+    Writer& Value(const std::string& value);
+    Writer& Value(const Node& node);
+    Writer& Null();
+
+    void Flush();
+
+  private:
+    static constexpr size_t FLUSH_THRESHOLD = 1 << 20;
+
+    struct Frame {
+      bool is_object;
+      size_t indent;
+      bool is_empty;
+    };
+
+    Writer(Mode mode, Frame frame);
+
+    size_t BeginValue();
+    void BeginContainer(bool is_object, char bracket);
+    void EndContainer(char bracket);
+    void Indent(size_t indent);
+    void FlushIfFull();
+
+    FILE* output_;
+    const Mode mode_;
+    std::string buffer_;
+    std::vector<Frame> frames_;
+  };
 }
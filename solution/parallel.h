@@ -0,0 +1,31 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <future>
+#include <vector>
+
+namespace Graph {
+
+  // Calls task(idx) for every idx in [0, task_count) on up to thread_count threads,
+  // the calling one included; tasks are handed out one at a time in index order
+  template <typename Task>
+  void RunConcurrently(size_t task_count, size_t thread_count, const Task& task) {
+    std::atomic<size_t> next_task = 0;
+    auto run_tasks = [&] {
+      for (size_t task_idx; (task_idx = next_task++) < task_count;) {
+        task(task_idx);
+      }
+    };
+    std::vector<std::future<void>> helpers;
+    for (size_t thread_idx = 1; thread_idx < std::min(thread_count, task_count); ++thread_idx) {
+      helpers.push_back(std::async(std::launch::async, run_tasks));
+    }
+    run_tasks();
+    for (auto& helper : helpers) {
+      helper.get();
+    }
+  }
+
+}
@@ -1,9 +1,11 @@
 #include "requests.h"
+#include "parallel.h"
 
+#include <algorithm>
 #include <sstream>
 #include <iomanip>
-#include <unordered_set>
 #include <iterator>
+#include <tuple>
 
 using namespace std;
 
@@ -18,120 +20,398 @@ RequestHolder Request::Create(Type type, int32_t id) {
 	case Type::ROUTE :
 		return std::make_unique<Requests::RouteInfo>(id);
 		break;
+	case Type::ROUTE_MATRIX :
+		return std::make_unique<Requests::RouteMatrix>(id);
+		break;
+	case Type::NEAREST_STOPS :
+		return std::make_unique<Requests::NearestStops>(id);
+		break;
+	case Type::GEO_ROUTE :
+		return std::make_unique<Requests::GeoRoute>(id);
+		break;
+	case Type::ISOCHRONE :
+		return std::make_unique<Requests::Isochrone>(id);
+		break;
 	default:
 		return nullptr;
 	}
 }
 
+namespace {
+// Wait and Bus items of a route through the graph, written into an open array
+void WriteRouteItems(const TransportManager& manager, const vector<Graph::EdgeId>& route_edges,
+										 Json::Writer& writer) {
+	auto write_bus_element = [&writer](string_view bus_name, int32_t span_count, double time) {
+		writer.BeginObject();
+		writer.Key("bus"sv).Value(bus_name);
+		writer.Key("span_count"sv).Value(span_count);
+		writer.Key("time"sv).Value(time);
+		writer.Key("type"sv).Value("Bus"sv);
+		writer.EndObject();
+	};
+
+	// Route-pattern graphs split a ride into one RIDE edge per hop; merge them back
+	TransportManager::EdgeInfo ride;
+	double ride_time = 0.0;
+
+	for (const Graph::EdgeId edge_id : route_edges) {
+		const Graph::Edge<EdgeWeight>& edge = manager.GetGraphEdge(edge_id);
+
+		if (edge.weight.type_ == EdgeType::BUS) {
+			const auto& edge_info = manager.GetEdgeInfoByEdgeId(edge_id);
+			write_bus_element(manager.GetBus(edge_info.bus_id).name_, edge_info.stops_count, edge.weight.weight_);
+		}
+
+		else if (edge.weight.type_ == EdgeType::RIDE) {
+			const auto& edge_info = manager.GetEdgeInfoByEdgeId(edge_id);
+			ride.bus_id = edge_info.bus_id;
+			ride.stops_count += edge_info.stops_count;
+			ride_time += edge.weight.weight_;
+		}
+
+		else if (edge.weight.type_ == EdgeType::ALIGHT) {
+			write_bus_element(manager.GetBus(ride.bus_id).name_, ride.stops_count, ride_time);
+			ride = {};
+			ride_time = 0.0;
+		}
+
+		else if (edge.weight.type_ == EdgeType::WAIT) {
+			writer.BeginObject();
+			writer.Key("stop_name"sv).Value(manager.GetStopByVertexId(edge.to).name_);
+			writer.Key("time"sv).Value(manager.GetBusWaitTime());
+			writer.Key("type"sv).Value("Wait"sv);
+			writer.EndObject();
+		}
+	}
+}
+
+// distance in meters; an empty stop name means the walk starts or ends off the network
+void WriteWalkItem(double distance, double time, string_view from_stop, string_view to_stop,
+									 Json::Writer& writer) {
+	writer.BeginObject();
+	writer.Key("distance"sv).Value(distance);
+	if (!from_stop.empty()) {
+		writer.Key("from"sv).Value(from_stop);
+	}
+	writer.Key("time"sv).Value(time);
+	if (!to_stop.empty()) {
+		writer.Key("to"sv).Value(to_stop);
+	}
+	writer.Key("type"sv).Value("Walk"sv);
+	writer.EndObject();
+}
+}
+
 namespace Requests {
-	Json::Node BusInfo::Process(const TransportManager& manager) const {
+	void BusInfo::Process(const TransportManager& manager, Json::Writer& writer) const {
 		auto bus_ptr = manager.GetBus(name);
-		map<string, Json::Node> result;
-		result["request_id"s] = Json::Node(request_id);
+		writer.BeginObject();
 
 		if (bus_ptr) {
-			auto bus_info_ptr = &bus_ptr->second;
-
-			const int32_t stop_count =
-				bus_info_ptr->type_ == TransportManager::Bus::Type::REGULAR ?
-				bus_info_ptr->stops_.size() * 2 - 1 :
-				bus_info_ptr->stops_.size();
-
-			const auto length = manager.ComputeDistanceForStop(bus_ptr->first);
+			const auto& stats = bus_ptr->stats_;
 
-			const int32_t unique_stop_count = unordered_set<TransportManager::ConstStopRawPtr>(
-				bus_info_ptr->stops_.begin(),
-				bus_info_ptr->stops_.end()
-			).size();
-			// assigning map
-			result["route_length"s] = Json::Node(static_cast<double>(length.by_default_));
-			result["curvature"s] = Json::Node(static_cast<double>(length.Curvature()));
-			result["stop_count"s] = Json::Node(static_cast<int32_t>(stop_count));
-			result["unique_stop_count"s] = Json::Node(static_cast<int32_t>(unique_stop_count));
+			writer.Key("curvature"sv).Value(stats.length_.Curvature());
+			writer.Key("request_id"sv).Value(request_id);
+			writer.Key("route_length"sv).Value(stats.length_.by_default_);
+			writer.Key("stop_count"sv).Value(stats.stop_count_);
+			writer.Key("unique_stop_count"sv).Value(stats.unique_stop_count_);
 		}
 
 		else {
-			result["error_message"s] = Json::Node("not found"s);
+			writer.Key("error_message"sv).Value("not found"sv);
+			writer.Key("request_id"sv).Value(request_id);
 		}
-		return Json::Node(std::move(result));
+		writer.EndObject();
 	}
 
-	void BusInfo::ParseFrom(const std::map<std::string, Json::Node>& request_map) {
+	void BusInfo::ParseFrom(const Json::Dict& request_map) {
 		name = request_map.at("name"s).AsString();
 	}
 
-	Json::Node StopInfo::Process(const TransportManager& manager) const {
+	void StopInfo::Process(const TransportManager& manager, Json::Writer& writer) const {
 		auto stop_ptr = manager.GetStop(name);
-		map<string, Json::Node> result;
-		result["request_id"s] = Json::Node(request_id);
+		writer.BeginObject();
 
 		if (stop_ptr) {
-			vector<Json::Node> buses;
-			for (string_view bus_view : stop_ptr->second.buses_) {
-				buses.push_back(Json::Node(string(bus_view)));
+			writer.Key("buses"sv).BeginArray();
+			for (string_view bus_view : stop_ptr->buses_) {
+				writer.Value(bus_view);
 			}
-			result.emplace("buses"s, Json::Node(std::move(buses)));
+			writer.EndArray();
 		}
 		else {
-			result["error_message"s] = Json::Node("not found"s);
+			writer.Key("error_message"sv).Value("not found"sv);
 		}
+		writer.Key("request_id"sv).Value(request_id);
 
-		return Json::Node(std::move(result));
+		writer.EndObject();
 	}
 
-	void StopInfo::ParseFrom(const std::map<std::string, Json::Node>& request_map) {
+	void StopInfo::ParseFrom(const Json::Dict& request_map) {
 		name = request_map.at("name"s).AsString();
 	}
 
-	void RouteInfo::ParseFrom(const std::map<std::string, Json::Node>& request_map) {
+	void NearestStops::ParseFrom(const Json::Dict& request_map) {
+		coords = GeoCoordinates(request_map.at("latitude"s).AsDouble(), request_map.at("longitude"s).AsDouble());
+		count = max(request_map.at("count"s).AsInt(), 0);
+	}
+
+	void NearestStops::Process(const TransportManager& manager, Json::Writer& writer) const {
+		writer.BeginObject();
+		writer.Key("request_id"sv).Value(request_id);
+		writer.Key("stops"sv).BeginArray();
+		for (const auto& stop : manager.FindNearestStops(coords, count)) {
+			writer.BeginObject();
+			writer.Key("distance"sv).Value(stop.distance);
+			writer.Key("stop_name"sv).Value(manager.GetStop(stop.id).name_);
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.EndObject();
+	}
+
+	void RouteInfo::ParseFrom(const Json::Dict& request_map) {
 		from = request_map.at("from"s).AsString();
 		to = request_map.at("to"s).AsString();
 	}
 
-	Json::Node RouteInfo::Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router) const {
-		auto route_info_opt = router.BuildRoute(
-			manager.GetVertexIdByWaitStop(from),
-			manager.GetVertexIdByWaitStop(to)
+	void RouteInfo::Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+													Json::Writer& writer, RouteCache* cache) const {
+		// A stop may be missing from the version this request is answered from, as when
+		// live updates add it after the request's shard started
+		const auto from_id = manager.FindStopId(from);
+		const auto to_id = manager.FindStopId(to);
+
+		writer.BeginObject();
+		if (!from_id || !to_id) {
+			writer.Key("error_message"sv).Value("not found"sv);
+			writer.Key("request_id"sv).Value(request_id);
+			writer.EndObject();
+			return;
+		}
+
+		optional<double> total_time;
+		if (cache) {
+			RouteCache::RouteHolder route = cache->Find(*from_id, *to_id);
+			if (!route) {
+				route = make_shared<const RouteCache::Route>(
+					RenderRoute(manager, router, *from_id, *to_id, writer.ValueWriter())
+				);
+				cache->Insert(*from_id, *to_id, route);
+			}
+			if (route->is_found) {
+				writer.Key("items"sv).RawValue(route->items);
+				total_time = route->total_time;
+			}
+		}
+		else {
+			// Nothing is kept, so the items go straight to the output
+			vector<Graph::EdgeId> route_edges;
+			if (const auto route_weight = FindRoute(manager, router, *from_id, *to_id, route_edges)) {
+				writer.Key("items"sv).BeginArray();
+				WriteRouteItems(manager, route_edges, writer);
+				writer.EndArray();
+				total_time = route_weight->weight_;
+			}
+		}
+
+		if (!total_time) {
+			writer.Key("error_message"sv).Value("not found"sv);
+		}
+		writer.Key("request_id"sv).Value(request_id);
+		if (total_time) {
+			writer.Key("total_time"sv).Value(*total_time);
+		}
+		writer.EndObject();
+	}
+
+	optional<EdgeWeight> RouteInfo::FindRoute(const TransportManager& manager,
+																						const Graph::Router<EdgeWeight>& router,
+																						TransportManager::StopId from_id, TransportManager::StopId to_id,
+																						vector<Graph::EdgeId>& route_edges) {
+		return router.FindRoute(
+			manager.GetVertexIdByWaitStop(from_id),
+			manager.GetVertexIdByWaitStop(to_id),
+			route_edges
 		);
+	}
 
-		map<string, Json::Node> result;
-		result["request_id"s] = request_id;
+	RouteCache::Route RouteInfo::RenderRoute(const TransportManager& manager,
+																					 const Graph::Router<EdgeWeight>& router,
+																					 TransportManager::StopId from_id, TransportManager::StopId to_id,
+																					 Json::Writer items_writer) {
+		vector<Graph::EdgeId> route_edges;
+		const auto route_weight = FindRoute(manager, router, from_id, to_id, route_edges);
+		if (!route_weight) {
+			return {};
+		}
+		items_writer.BeginArray();
+		WriteRouteItems(manager, route_edges, items_writer);
+		items_writer.EndArray();
+		return {true, items_writer.ExtractBuffer(), route_weight->weight_};
+	}
 
-		if (!route_info_opt) {
-			result["error_message"s] = "not found"s;
-			return Json::Node{ std::move(result) };
+	void RouteMatrix::ParseFrom(const Json::Dict& request_map) {
+		for (const auto& node : request_map.at("from"s).AsArray()) {
+			from.emplace_back(node.AsString());
 		}
+		for (const auto& node : request_map.at("to"s).AsArray()) {
+			to.emplace_back(node.AsString());
+		}
+	}
 
-		auto& route_info = *route_info_opt;
-		result["total_time"s] = route_info.weight.weight_;
+	void RouteMatrix::Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+														Json::Writer& writer, size_t thread_count) const {
+		// One unknown stop fails the whole request
+		auto find_vertices = [&manager](const vector<string>& stop_names) -> optional<vector<Graph::VertexId>> {
+			vector<Graph::VertexId> vertices;
+			vertices.reserve(stop_names.size());
+			for (const auto& stop_name : stop_names) {
+				const auto stop_id = manager.FindStopId(stop_name);
+				if (!stop_id) {
+					return nullopt;
+				}
+				vertices.push_back(manager.GetVertexIdByWaitStop(*stop_id));
+			}
+			return vertices;
+		};
+		const auto sources = find_vertices(from);
+		const auto targets = find_vertices(to);
 
-		vector<Json::Node> route_elements;
+		writer.BeginObject();
+		if (!sources || !targets) {
+			writer.Key("error_message"sv).Value("not found"sv);
+			writer.Key("request_id"sv).Value(request_id);
+			writer.EndObject();
+			return;
+		}
 
-		for (size_t idx = 0; idx < route_info.edge_count; ++idx) {
-			const Graph::EdgeId edge_id = router.GetRouteEdge(route_info.id, idx);
-			const Graph::Edge<EdgeWeight>& edge = manager.GetGraphEdge(edge_id);
+		vector<vector<optional<EdgeWeight>>> rows(sources->size());
+		Graph::RunConcurrently(sources->size(), thread_count, [&](size_t row) {
+			rows[row] = router.FindRouteWeights((*sources)[row], *targets);
+		});
 
-			if (edge.weight.type_ == EdgeType::BUS) {
-				const auto& edge_info = manager.GetEdgeInfoByEdgeId(edge_id);
-				route_elements.push_back(Json::Node{ map<string, Json::Node>{
-					{ "type"s, "Bus"s },
-					{ "bus"s, edge_info.bus_ptr->first },
-					{ "span_count"s, edge_info.stops_count },
-					{ "time"s, edge.weight.weight_ },
-				} });
-				
+		writer.Key("request_id"sv).Value(request_id);
+		writer.Key("total_times"sv).BeginArray();
+		for (const auto& row : rows) {
+			writer.BeginArray();
+			for (const auto& weight : row) {
+				if (weight) {
+					writer.Value(weight->weight_);
+				}
+				else {
+					writer.Null();
+				}
 			}
+			writer.EndArray();
+		}
+		writer.EndArray();
+		writer.EndObject();
+	}
 
-			else if (edge.weight.type_ == EdgeType::WAIT) {
-				route_elements.push_back(Json::Node{ map<string, Json::Node>{
-					{"type"s, "Wait"s},
-					{ "stop_name"s, manager.GetStopByVertexId(edge.to)->first },
-					{ "time"s, manager.GetBusWaitTime() }
-				} });
+	void GeoRoute::ParseFrom(const Json::Dict& request_map) {
+		auto parse_coords = [](const Json::Node& node) {
+			const auto& coords_map = node.AsMap();
+			return GeoCoordinates(coords_map.at("latitude"s).AsDouble(), coords_map.at("longitude"s).AsDouble());
+		};
+		from = parse_coords(request_map.at("from"s));
+		to = parse_coords(request_map.at("to"s));
+	}
+
+	void GeoRoute::Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+												 Json::Writer& writer) const {
+		using Endpoint = Graph::Router<EdgeWeight>::Endpoint;
+		const double meters_per_minute = manager.GetPedestrianVelocity() * 1000.0;
+
+		const auto from_stops = manager.FindNearestStops(from, WALK_STOP_COUNT);
+		const auto to_stops = manager.FindNearestStops(to, WALK_STOP_COUNT);
+		vector<Endpoint> sources, targets;
+		for (const auto& stop : from_stops) {
+			sources.push_back({ manager.GetVertexIdByWaitStop(stop.id), stop.distance / meters_per_minute });
+		}
+		for (const auto& stop : to_stops) {
+			targets.push_back({ manager.GetVertexIdByWaitStop(stop.id), stop.distance / meters_per_minute });
+		}
+
+		vector<Graph::EdgeId> route_edges;
+		const auto route = router.FindOverlayRoute(sources, targets, route_edges);
+		const double direct_distance = ComputeStableDistanceForCoords(from, to);
+		const double direct_time = direct_distance / meters_per_minute;
+
+		const bool is_walk_only = !route || direct_time <= route->weight.weight_;
+
+		writer.BeginObject();
+		writer.Key("items"sv).BeginArray();
+		if (is_walk_only) {
+			WriteWalkItem(direct_distance, direct_time, {}, {}, writer);
+		}
+		else {
+			const auto& first_stop = from_stops[route->source_idx];
+			const auto& last_stop = to_stops[route->target_idx];
+			WriteWalkItem(first_stop.distance, sources[route->source_idx].weight.weight_,
+										{}, manager.GetStop(first_stop.id).name_, writer);
+			WriteRouteItems(manager, route_edges, writer);
+			WriteWalkItem(last_stop.distance, targets[route->target_idx].weight.weight_,
+										manager.GetStop(last_stop.id).name_, {}, writer);
+		}
+		writer.EndArray();
+		writer.Key("request_id"sv).Value(request_id);
+		writer.Key("total_time"sv).Value(is_walk_only ? direct_time : route->weight.weight_);
+		writer.EndObject();
+	}
+
+	void Isochrone::ParseFrom(const Json::Dict& request_map) {
+		from = request_map.at("from"s).AsString();
+		max_time = request_map.at("max_time"s).AsDouble();
+		hull = request_map.count("hull"s) > 0 && request_map.at("hull"s).AsBool();
+	}
+
+	void Isochrone::Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+													Json::Writer& writer) const {
+		writer.BeginObject();
+		const auto from_id = manager.FindStopId(from);
+		if (!from_id) {
+			writer.Key("error_message"sv).Value("not found"sv);
+			writer.Key("request_id"sv).Value(request_id);
+			writer.EndObject();
+			return;
+		}
+
+		// Route-pattern graphs reach ride vertices too; only wait vertices stand for stops
+		vector<pair<const TransportManager::Stop*, double>> reached;
+		for (const auto& [vertex, weight] : router.FindReachable(manager.GetVertexIdByWaitStop(*from_id), max_time)) {
+			if (const auto* stop = manager.FindStopByWaitVertex(vertex)) {
+				reached.emplace_back(stop, weight.weight_);
 			}
 		}
+		sort(reached.begin(), reached.end(), [](const auto& lhs, const auto& rhs) {
+			return tie(lhs.second, lhs.first->name_) < tie(rhs.second, rhs.first->name_);
+		});
 
-		result["items"s] = std::move(route_elements);
-		return Json::Node{ std::move(result) };
+		if (hull) {
+			vector<GeoCoordinates> points;
+			points.reserve(reached.size());
+			for (const auto& [stop, time] : reached) {
+				points.push_back(stop->coords_);
+			}
+			writer.Key("hull"sv).BeginArray();
+			for (const GeoCoordinates& coords : ComputeConvexHull(move(points))) {
+				writer.BeginObject();
+				writer.Key("latitude"sv).Value(GeoCoordinates::ToDegree(coords.latitude_));
+				writer.Key("longitude"sv).Value(GeoCoordinates::ToDegree(coords.longitude_));
+				writer.EndObject();
+			}
+			writer.EndArray();
+		}
+		writer.Key("request_id"sv).Value(request_id);
+		writer.Key("stops"sv).BeginArray();
+		for (const auto& [stop, time] : reached) {
+			writer.BeginObject();
+			writer.Key("stop_name"sv).Value(stop->name_);
+			writer.Key("time"sv).Value(time);
+			writer.EndObject();
+		}
+		writer.EndArray();
+		writer.EndObject();
 	}
-}
\ No newline at end of file
+}
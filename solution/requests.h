@@ -2,11 +2,14 @@
 
 #include "transport_manager.h"
 #include "json.h"
+#include "route_cache.h"
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 
 struct Request;
 using RequestHolder = std::unique_ptr<Request>;
@@ -15,51 +18,124 @@ struct Request {
 	enum class Type {
 		BUS,
 		STOP,
-		ROUTE
+		ROUTE,
+		ROUTE_MATRIX,
+		NEAREST_STOPS,
+		GEO_ROUTE,
+		ISOCHRONE
 	};
 	Request(Type t, size_t id) : type(t), request_id(id) {}
 	static RequestHolder Create(Type type, int32_t id);
-	virtual void ParseFrom(const std::map<std::string, Json::Node>& request_map) = 0;
+	virtual void ParseFrom(const Json::Dict& request_map) = 0;
 	virtual ~Request() = default;
 	const Type type;
 	int32_t request_id;
 };
 
 
+// Responses are streamed into a Json::Writer. Keys are written in alphabetical order
+// so that the output matches what Json::Print produces for the equivalent std::map.
 namespace Requests {
-	template <typename ReturnType>
 	struct Read : Request {
 		using Request::Request;
-		virtual ReturnType Process(const TransportManager& manager) const = 0;
+		virtual void Process(const TransportManager& manager, Json::Writer& writer) const = 0;
 	};
 
-	struct BusInfo : Read<Json::Node> {
+	struct BusInfo : Read {
 		BusInfo(int32_t id) : Read(Type::BUS, id) {}
 
-		void ParseFrom(const std::map<std::string, Json::Node>& request_map) override;
+		void ParseFrom(const Json::Dict& request_map) override;
 
-		Json::Node Process(const TransportManager& manager) const override;
+		void Process(const TransportManager& manager, Json::Writer& writer) const override;
 
 		std::string name;
 	};
 
-	struct StopInfo : Read<Json::Node> {
+	struct StopInfo : Read {
 		StopInfo(int32_t id) : Read(Type::STOP, id) {}
 
-		void ParseFrom(const std::map<std::string, Json::Node>& request_map) override;
+		void ParseFrom(const Json::Dict& request_map) override;
 
-		Json::Node Process(const TransportManager& manager) const override;
+		void Process(const TransportManager& manager, Json::Writer& writer) const override;
 
 		std::string name;
 	};
 
+	// Up to count stops closest to a position, nearest first
+	struct NearestStops : Read {
+		NearestStops(int32_t id) : Read(Type::NEAREST_STOPS, id), coords(0.0, 0.0) {}
+
+		void ParseFrom(const Json::Dict& request_map) override;
+
+		void Process(const TransportManager& manager, Json::Writer& writer) const override;
+
+		GeoCoordinates coords;
+		size_t count = 0;
+	};
+
 	struct RouteInfo : Request {
 		RouteInfo(int32_t id) : Request(Type::ROUTE, id) {}
 
-		void ParseFrom(const std::map<std::string, Json::Node>& request_map) override;
+		void ParseFrom(const Json::Dict& request_map) override;
 
-		Json::Node Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router) const;
+		// With a cache, responses for a known pair of stops are repeated from it
+		void Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+								 Json::Writer& writer, RouteCache* cache = nullptr) const;
 		std::string from;
 		std::string to;
+
+	private:
+		static std::optional<EdgeWeight> FindRoute(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+																							 TransportManager::StopId from_id, TransportManager::StopId to_id,
+																							 std::vector<Graph::EdgeId>& route_edges);
+		// Renders the "items" array with a writer made by Json::Writer::ValueWriter()
+		static RouteCache::Route RenderRoute(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+																				 TransportManager::StopId from_id, TransportManager::StopId to_id,
+																				 Json::Writer items_writer);
+	};
+
+	// Door-to-door route between two positions. The route walks to one of the stops nearest
+	// to the start, rides, and walks from one of the stops nearest to the end, unless walking
+	// all the way is faster. Walks are overlay edges of the query only.
+	struct GeoRoute : Request {
+		GeoRoute(int32_t id) : Request(Type::GEO_ROUTE, id), from(0.0, 0.0), to(0.0, 0.0) {}
+
+		void ParseFrom(const Json::Dict& request_map) override;
+
+		void Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+								 Json::Writer& writer) const;
+		GeoCoordinates from;
+		GeoCoordinates to;
+
+	private:
+		static const size_t WALK_STOP_COUNT = 8;
+	};
+
+	// Total times from every "from" stop to every "to" stop, null where there is no route,
+	// or "not found" when any of the stops is unknown. Each row is a single one-to-many
+	// search; rows are searched on up to thread_count threads.
+	struct RouteMatrix : Request {
+		RouteMatrix(int32_t id) : Request(Type::ROUTE_MATRIX, id) {}
+
+		void ParseFrom(const Json::Dict& request_map) override;
+
+		void Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+								 Json::Writer& writer, size_t thread_count = 1) const;
+		std::vector<std::string> from;
+		std::vector<std::string> to;
+	};
+
+	// Stops reachable from a stop within max_time, by time, from a single search bounded
+	// by the budget. With hull set, also the convex hull of the reached stops.
+	struct Isochrone : Request {
+		Isochrone(int32_t id) : Request(Type::ISOCHRONE, id) {}
+
+		void ParseFrom(const Json::Dict& request_map) override;
+
+		void Process(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+								 Json::Writer& writer) const;
+		std::string from;
+		double max_time = 0.0;
+		bool hull = false;
 	};
 }
@@ -0,0 +1,99 @@
+#include "road_distances.h"
+#include "snapshot.h"
+
+using namespace std;
+
+uint64_t RoadDistances::PackKey(StopId from, StopId to) {
+	return (static_cast<uint64_t>(from) << 32) | to;
+}
+
+uint64_t RoadDistances::Hash(uint64_t key) {
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdULL;
+	key ^= key >> 33;
+	return key;
+}
+
+size_t RoadDistances::FindSlot(uint64_t key) const {
+	const size_t mask = slots_.size() - 1;
+	size_t idx = Hash(key) & mask;
+	while (slots_[idx].key != key && slots_[idx].key != EMPTY_KEY) {
+		idx = (idx + 1) & mask;
+	}
+	return idx;
+}
+
+void RoadDistances::Rehash(size_t capacity) {
+	vector<Slot> old_slots(capacity);
+	old_slots.swap(slots_);
+	for (const Slot& slot : old_slots) {
+		if (slot.key != EMPTY_KEY) {
+			slots_[FindSlot(slot.key)] = slot;
+		}
+	}
+}
+
+void RoadDistances::Reserve(size_t count) {
+	size_t capacity = 16;
+	while (capacity < count * 2) {
+		capacity *= 2;
+	}
+	if (capacity > slots_.size()) {
+		Rehash(capacity);
+	}
+}
+
+RoadDistances::Slot& RoadDistances::Insert(StopId from, StopId to) {
+	if ((size_ + 1) * 2 > slots_.size()) {
+		Reserve(size_ + 1);
+	}
+	const uint64_t key = PackKey(from, to);
+	Slot& slot = slots_[FindSlot(key)];
+	if (slot.key == EMPTY_KEY) {
+		slot.key = key;
+		++size_;
+	}
+	return slot;
+}
+
+void RoadDistances::Set(StopId from, StopId to, double distance) {
+	Slot& slot = Insert(from, to);
+	slot.distance = distance;
+	slot.is_explicit = true;
+}
+
+void RoadDistances::SetImplied(StopId from, StopId to, double distance) {
+	Slot& slot = Insert(from, to);
+	if (!slot.is_explicit) {
+		slot.distance = distance;
+	}
+}
+
+optional<double> RoadDistances::Find(StopId from, StopId to) const {
+	if (slots_.empty()) {
+		return nullopt;
+	}
+	const Slot& slot = slots_[FindSlot(PackKey(from, to))];
+	if (slot.key == EMPTY_KEY) {
+		return nullopt;
+	}
+	return slot.distance;
+}
+
+bool RoadDistances::Contains(StopId from, StopId to) const {
+	return Find(from, to).has_value();
+}
+
+size_t RoadDistances::Size() const {
+	return size_;
+}
+
+void RoadDistances::Save(Snapshot::Writer& writer) const {
+	writer.Write(static_cast<uint64_t>(size_));
+	writer.WriteArray(slots_);
+}
+
+void RoadDistances::Load(Snapshot::Reader& reader) {
+	size_ = reader.Read<uint64_t>();
+	slots_ = reader.ReadArray<Slot>();
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <optional>
+
+namespace Snapshot {
+	class Writer;
+	class Reader;
+}
+
+// Road distances between stops, keyed by the (from, to) pair of dense stop ids
+// packed into 64 bits. Open addressing with linear probing keeps every lookup to
+// one hash and a short scan over a flat array. An entry is either explicit or implied
+// by the explicit distance in the opposite direction; only explicit ones are final.
+class RoadDistances {
+public:
+	using StopId = uint32_t;
+
+	void Reserve(size_t count);
+	void Set(StopId from, StopId to, double distance);
+	// Does not override an explicit distance
+	void SetImplied(StopId from, StopId to, double distance);
+	std::optional<double> Find(StopId from, StopId to) const;
+	bool Contains(StopId from, StopId to) const;
+	size_t Size() const;
+
+	void Save(Snapshot::Writer& writer) const;
+	void Load(Snapshot::Reader& reader);
+
+private:
+	static constexpr uint64_t EMPTY_KEY = UINT64_MAX;
+
+	struct Slot {
+		uint64_t key = EMPTY_KEY;
+		double distance = 0.0;
+		bool is_explicit = false;
+		// Slots are written to snapshots as is, so the bytes after is_explicit are zeroed
+		uint8_t reserved[7] = {};
+	};
+	static_assert(sizeof(Slot) == sizeof(uint64_t) * 3, "Slot must have no padding");
+
+	static uint64_t PackKey(StopId from, StopId to);
+	static uint64_t Hash(uint64_t key);
+
+	size_t FindSlot(uint64_t key) const;
+	Slot& Insert(StopId from, StopId to);
+	void Rehash(size_t capacity);
+
+	std::vector<Slot> slots_;
+	size_t size_ = 0;
+};
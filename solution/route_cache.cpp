@@ -0,0 +1,61 @@
+#include "route_cache.h"
+
+#include <algorithm>
+
+using namespace std;
+
+RouteCache::RouteCache(size_t capacity)
+	: shard_capacity_(max<size_t>((capacity + SHARD_COUNT - 1) / SHARD_COUNT, 1)),
+		shards_(SHARD_COUNT)
+{
+}
+
+uint64_t RouteCache::MakeKey(StopId from, StopId to) {
+	return static_cast<uint64_t>(from) << 32 | to;
+}
+
+RouteCache::Shard& RouteCache::GetShard(uint64_t key) {
+	// Fibonacci hashing, so that neighbouring stop ids land in different shards
+	return shards_[(key * 0x9E3779B97F4A7C15ull) >> (64 - SHARD_BITS)];
+}
+
+RouteCache::RouteHolder RouteCache::Find(StopId from, StopId to) {
+	const uint64_t key = MakeKey(from, to);
+	Shard& shard = GetShard(key);
+	lock_guard<mutex> lock(shard.mutex);
+	const auto it = shard.index.find(key);
+	if (it == shard.index.end()) {
+		misses_.fetch_add(1, memory_order_relaxed);
+		return nullptr;
+	}
+	hits_.fetch_add(1, memory_order_relaxed);
+	shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+	return it->second->second;
+}
+
+void RouteCache::Insert(StopId from, StopId to, RouteHolder route) {
+	const uint64_t key = MakeKey(from, to);
+	Shard& shard = GetShard(key);
+	lock_guard<mutex> lock(shard.mutex);
+	if (const auto it = shard.index.find(key); it != shard.index.end()) {
+		// Another thread rendered the same route meanwhile
+		it->second->second = move(route);
+		shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+		return;
+	}
+	if (shard.entries.size() == shard_capacity_) {
+		shard.index.erase(shard.entries.back().first);
+		shard.entries.pop_back();
+		evictions_.fetch_add(1, memory_order_relaxed);
+	}
+	shard.entries.emplace_front(key, move(route));
+	shard.index.emplace(key, shard.entries.begin());
+}
+
+RouteCache::Stats RouteCache::GetStats() const {
+	return {
+		hits_.load(memory_order_relaxed),
+		misses_.load(memory_order_relaxed),
+		evictions_.load(memory_order_relaxed)
+	};
+}
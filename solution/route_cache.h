@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Rendered Route responses keyed by the (from, to) pair of dense stop ids. Keys are
+// spread over independently locked shards, and a full shard evicts its least recently
+// used entry. Entries are shared, so a hit only copies a pointer under the lock.
+class RouteCache {
+public:
+	using StopId = uint32_t;
+
+	struct Route {
+		bool is_found = false;
+		// The rendered "items" array, ready for Json::Writer::RawValue()
+		std::string items;
+		double total_time = 0.0;
+	};
+	using RouteHolder = std::shared_ptr<const Route>;
+
+	struct Stats {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+	};
+
+	explicit RouteCache(size_t capacity);
+
+	// Returns nullptr on a miss
+	RouteHolder Find(StopId from, StopId to);
+	void Insert(StopId from, StopId to, RouteHolder route);
+
+	Stats GetStats() const;
+
+private:
+	static constexpr size_t SHARD_BITS = 4;
+	static constexpr size_t SHARD_COUNT = 1 << SHARD_BITS;
+
+	struct Shard {
+		using Entries = std::list<std::pair<uint64_t, RouteHolder>>;
+
+		std::mutex mutex;
+		Entries entries;  // most recently used first
+		std::unordered_map<uint64_t, Entries::iterator> index;
+	};
+
+	static uint64_t MakeKey(StopId from, StopId to);
+	Shard& GetShard(uint64_t key);
+
+	size_t shard_capacity_;
+	std::vector<Shard> shards_;
+	std::atomic<uint64_t> hits_ = 0;
+	std::atomic<uint64_t> misses_ = 0;
+	std::atomic<uint64_t> evictions_ = 0;
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include "graph.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+  // Memory-lean all-pairs index: a row for every vertex routes may start from and a column
+  // for every vertex that does not have exactly one incoming edge. A vertex with a single
+  // incoming edge is always entered through it, so it needs no column. A cell holds only the
+  // last edge of the route from the row's vertex. Routes are unrolled from the row of their
+  // source, and their weight is summed back from the original edges. Rows are filled by
+  // one Dijkstra search per source, spread over threads.
+  template <typename Weight>
+  class RouteTable {
+  private:
+    using Graph = DirectedWeightedGraph<Weight>;
+
+  public:
+    RouteTable(const Graph& graph, const std::vector<VertexId>& sources, size_t thread_count = 1);
+
+    bool HasSource(VertexId vertex) const;
+
+    // from must be a source; graph must be the one the table was built for
+    std::optional<Weight> FindRoute(const Graph& graph, VertexId from, VertexId to,
+                                    std::vector<EdgeId>& edges) const;
+
+    template <typename Writer>
+    void Save(Writer& writer) const;
+    template <typename Reader>
+    static RouteTable Load(Reader& reader);
+
+  private:
+    RouteTable() = default;
+
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    struct QueueItem {
+      double weight;
+      VertexId vertex;
+
+      bool operator < (const QueueItem& other) const {
+        return other.weight < weight;
+      }
+    };
+
+    void FillRow(const Graph& graph, VertexId source, uint32_t* row) const;
+
+    std::vector<uint32_t> rows_;           // by vertex, NONE unless a source
+    std::vector<uint32_t> columns_;        // by vertex, NONE for single incoming edge vertices
+    std::vector<uint32_t> entering_edges_; // by vertex, the single incoming edge or NONE
+    uint64_t column_count_ = 0;
+    std::vector<uint32_t> last_edges_;
+  };
+
+
+  template <typename Weight>
+  RouteTable<Weight>::RouteTable(const Graph& graph, const std::vector<VertexId>& sources, size_t thread_count)
+      : rows_(graph.GetVertexCount(), NONE),
+        columns_(graph.GetVertexCount(), NONE),
+        entering_edges_(graph.GetVertexCount(), NONE)
+  {
+    assert(graph.GetEdgeCount() < NONE);
+    // Edges removed from the graph keep their ids, so only linked edges are counted
+    std::vector<uint32_t> in_degrees(graph.GetVertexCount());
+    for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+      graph.ForEachIncidentEdge(vertex, [&](EdgeId edge_id, VertexId edge_to, const Weight&) {
+        ++in_degrees[edge_to];
+        entering_edges_[edge_to] = edge_id;
+      });
+    }
+    for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+      if (in_degrees[vertex] != 1) {
+        columns_[vertex] = column_count_++;
+        entering_edges_[vertex] = NONE;
+      }
+    }
+    for (size_t row = 0; row < sources.size(); ++row) {
+      rows_[sources[row]] = row;
+    }
+
+    last_edges_.assign(sources.size() * column_count_, NONE);
+    RunConcurrently(sources.size(), thread_count, [&](size_t row) {
+      FillRow(graph, sources[row], &last_edges_[row * column_count_]);
+    });
+  }
+
+  template <typename Weight>
+  void RouteTable<Weight>::FillRow(const Graph& graph, VertexId source, uint32_t* row) const {
+    static thread_local std::vector<double> weights;
+    static thread_local std::vector<uint32_t> last_edges;
+    weights.assign(graph.GetVertexCount(), std::numeric_limits<double>::infinity());
+    last_edges.assign(graph.GetVertexCount(), NONE);
+
+    std::priority_queue<QueueItem> queue;
+    weights[source] = 0;
+    queue.push({0, source});
+    while (!queue.empty()) {
+      const QueueItem item = queue.top();
+      queue.pop();
+      if (weights[item.vertex] < item.weight) {
+        continue;
+      }
+      graph.ForEachIncidentEdge(item.vertex, [&](EdgeId edge_id, VertexId edge_to, const Weight& edge_weight) {
+        assert(edge_weight >= 0);
+        const double candidate_weight = item.weight + static_cast<double>(edge_weight);
+        if (candidate_weight < weights[edge_to]) {
+          weights[edge_to] = candidate_weight;
+          last_edges[edge_to] = edge_id;
+          queue.push({candidate_weight, edge_to});
+        }
+      });
+    }
+
+    for (VertexId vertex = 0; vertex < graph.GetVertexCount(); ++vertex) {
+      if (columns_[vertex] != NONE) {
+        row[columns_[vertex]] = last_edges[vertex];
+      }
+    }
+  }
+
+  template <typename Weight>
+  bool RouteTable<Weight>::HasSource(VertexId vertex) const {
+    return rows_[vertex] != NONE;
+  }
+
+  template <typename Weight>
+  std::optional<Weight> RouteTable<Weight>::FindRoute(const Graph& graph, VertexId from, VertexId to,
+                                                      std::vector<EdgeId>& edges) const {
+    const uint32_t* row = &last_edges_[rows_[from] * column_count_];
+    for (VertexId vertex = to; vertex != from;) {
+      const uint32_t edge_id = columns_[vertex] != NONE ? row[columns_[vertex]] : entering_edges_[vertex];
+      // The second check stops on cycles of single incoming edge vertices unreachable from the source
+      if (edge_id == NONE || edges.size() == graph.GetVertexCount()) {
+        edges.clear();
+        return std::nullopt;
+      }
+      edges.push_back(edge_id);
+      vertex = graph.GetEdge(edge_id).from;
+    }
+    std::reverse(std::begin(edges), std::end(edges));
+
+    Weight weight = 0;
+    for (const EdgeId edge_id : edges) {
+      weight += graph.GetEdge(edge_id).weight;
+    }
+    return weight;
+  }
+
+  template <typename Weight>
+  template <typename Writer>
+  void RouteTable<Weight>::Save(Writer& writer) const {
+    writer.WriteArray(rows_);
+    writer.WriteArray(columns_);
+    writer.WriteArray(entering_edges_);
+    writer.Write(column_count_);
+    writer.WriteArray(last_edges_);
+  }
+
+  template <typename Weight>
+  template <typename Reader>
+  RouteTable<Weight> RouteTable<Weight>::Load(Reader& reader) {
+    RouteTable table;
+    table.rows_ = reader.template ReadArray<uint32_t>();
+    table.columns_ = reader.template ReadArray<uint32_t>();
+    table.entering_edges_ = reader.template ReadArray<uint32_t>();
+    table.column_count_ = reader.template Read<uint64_t>();
+    table.last_edges_ = reader.template ReadArray<uint32_t>();
+    return table;
+  }
+}
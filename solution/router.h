@@ -1,25 +1,52 @@
 #pragma once
 
+#include "contraction_hierarchy.h"
+#include "floyd_warshall.h"
 #include "graph.h"
+#include "route_table.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
 #include <iterator>
+#include <mutex>
+#include <numeric>
 #include <optional>
+#include <queue>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 namespace Graph {
 
+  enum class RouterMode {
+    ALL_PAIRS,             // blocked Floyd-Warshall precomputation, O(V^3) startup, O(1) lookups
+    ON_DEMAND,             // Dijkstra per query, no precomputation, linear memory
+    CONTRACTION_HIERARCHY, // one-off contraction, bidirectional upward search per query
+    ALL_PAIRS_COMPACT      // Dijkstra per source, last edges only for sources x entry vertices
+  };
+
   template <typename Weight>
   class Router {
   private:
     using Graph = DirectedWeightedGraph<Weight>;
 
   public:
-    Router(const Graph& graph);
+    // thread_count only speeds up the all-pairs precomputations. ALL_PAIRS_COMPACT keeps
+    // rows for sources only, all vertices when empty; routes from other vertices fall back
+    // to ON_DEMAND searches. The default mode is the one of the serving settings.
+    Router(const Graph& graph, RouterMode mode = RouterMode::ON_DEMAND, size_t thread_count = 1,
+           std::vector<VertexId> sources = {});
+
+    // Restores the mode and index stored by Save() instead of recomputing them;
+    // graph must be the one the index was built for
+    template <typename Reader>
+    Router(const Graph& graph, Reader& reader);
+
+    template <typename Writer>
+    void Save(Writer& writer) const;
+
+    RouterMode GetMode() const;
 
     using RouteId = uint64_t;
 
@@ -29,109 +56,392 @@ namespace Graph {
       size_t edge_count;
     };
 
+    // Fills edges with the route and returns its weight. Keeps no state in the router,
+    // so any number of threads may query concurrently.
+    std::optional<Weight> FindRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const;
+
+    // Weights of the routes from one vertex to each of targets, without expanding them.
+    // Searching modes answer all the targets from a single one-to-many search.
+    std::vector<std::optional<Weight>> FindRouteWeights(VertexId from, const std::vector<VertexId>& targets) const;
+
+    // Every vertex whose route from `from` weighs at most max_weight, with that weight,
+    // lightest first. Searching modes stop the search at the budget.
+    std::vector<std::pair<VertexId, Weight>> FindReachable(VertexId from, const Weight& max_weight) const;
+
+    // A vertex joined to a query endpoint by a virtual edge of the given weight
+    struct Endpoint {
+      VertexId vertex;
+      Weight weight;
+    };
+
+    struct OverlayRoute {
+      Weight weight;
+      size_t source_idx;
+      size_t target_idx;
+    };
+
+    // Lightest route from any of sources to any of targets, endpoint weights included.
+    // The endpoints act as per-query overlay edges, the graph itself is left untouched;
+    // edges is filled with the graph part of the route only.
+    std::optional<OverlayRoute> FindOverlayRoute(const std::vector<Endpoint>& sources,
+                                                 const std::vector<Endpoint>& targets,
+                                                 std::vector<EdgeId>& edges) const;
+
+    // Legacy handle-based API: expanded routes are kept until ReleaseRoute()
     std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const;
     EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const;
     void ReleaseRoute(RouteId route_id);
 
   private:
     const Graph& graph_;
+    const RouterMode mode_;
 
     struct RouteInternalData {
       Weight weight;
       std::optional<EdgeId> prev_edge;
     };
-    using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
 
     using ExpandedRoute = std::vector<EdgeId>;
+    mutable std::mutex expanded_routes_mutex_;
     mutable RouteId next_route_id_ = 0;
     mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
 
-    void InitializeRoutesInternalData(const Graph& graph) {
-      const size_t vertex_count = graph.GetVertexCount();
-      for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
-        routes_internal_data_[vertex][vertex] = RouteInternalData{0, std::nullopt};
-        for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
-          const auto& edge = graph.GetEdge(edge_id);
-          assert(edge.weight >= 0);
-          auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-          if (!route_internal_data || route_internal_data->weight > edge.weight) {
-            route_internal_data = RouteInternalData{edge.weight, edge_id};
+    struct QueueItem {
+      Weight weight;
+      VertexId vertex;
+
+      bool operator < (const QueueItem& other) const {
+        // std::priority_queue is a max-heap, so the lightest item must compare greatest
+        return other.weight < weight;
+      }
+    };
+
+    // Dijkstra state reused by consecutive queries of one thread; only the vertices
+    // touched by the previous search are reset
+    struct SearchSpace {
+      std::vector<std::optional<RouteInternalData>> routes;
+      std::vector<VertexId> touched;
+
+      void Reset(size_t vertex_count) {
+        for (const VertexId vertex : touched) {
+          routes[vertex].reset();
+        }
+        touched.clear();
+        if (routes.size() != vertex_count) {
+          routes.assign(vertex_count, std::nullopt);
+        }
+      }
+    };
+
+    // Dijkstra over the search space of the calling thread, started from every source at
+    // its weight; stops once is_done(vertex, weight) holds for a settled vertex
+    template <typename IsDone>
+    const SearchSpace& SearchOnDemand(const Endpoint* sources, size_t source_count, IsDone is_done) const {
+      static thread_local SearchSpace search_space;
+      search_space.Reset(graph_.GetVertexCount());
+      auto& routes = search_space.routes;
+      auto& touched = search_space.touched;
+      std::priority_queue<QueueItem> queue;
+
+      for (const Endpoint* source = sources; source != sources + source_count; ++source) {
+        auto& route = routes[source->vertex];
+        if (!route || source->weight < route->weight) {
+          if (!route) {
+            touched.push_back(source->vertex);
           }
+          route = RouteInternalData{source->weight, std::nullopt};
+          queue.push({source->weight, source->vertex});
+        }
+      }
+      while (!queue.empty()) {
+        const QueueItem item = queue.top();
+        queue.pop();
+        if (routes[item.vertex]->weight < item.weight) {
+          continue;  // stale entry, the vertex was already settled cheaper
         }
+        if (is_done(item.vertex, item.weight)) {
+          break;
+        }
+        graph_.ForEachIncidentEdge(item.vertex, [&](EdgeId edge_id, VertexId edge_to, const Weight& edge_weight) {
+          assert(edge_weight >= 0);
+          const Weight candidate_weight = item.weight + edge_weight;
+          auto& route = routes[edge_to];
+          if (!route || candidate_weight < route->weight) {
+            if (!route) {
+              touched.push_back(edge_to);
+            }
+            route = RouteInternalData{candidate_weight, edge_id};
+            queue.push({candidate_weight, edge_to});
+          }
+        });
       }
+      return search_space;
     }
 
-    void RelaxRoute(VertexId vertex_from, VertexId vertex_to,
-                    const RouteInternalData& route_from, const RouteInternalData& route_to) {
-      auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
-      const Weight candidate_weight = route_from.weight + route_to.weight;
-      if (!route_relaxing || candidate_weight < route_relaxing->weight) {
-        route_relaxing = {
-            candidate_weight,
-            route_to.prev_edge
-                ? route_to.prev_edge
-                : route_from.prev_edge
-        };
+    template <typename IsDone>
+    const SearchSpace& SearchOnDemand(VertexId from, IsDone is_done) const {
+      const Endpoint source{from, 0};
+      return SearchOnDemand(&source, 1, is_done);
+    }
+
+    // Unrolls the route to vertex found by the last search of the calling thread;
+    // returns the vertex the route starts from
+    VertexId UnrollSearchRoute(const SearchSpace& search_space, VertexId vertex, ExpandedRoute& edges) const {
+      const auto& routes = search_space.routes;
+      for (std::optional<EdgeId> edge_id = routes[vertex]->prev_edge;
+           edge_id;
+           edge_id = routes[vertex]->prev_edge) {
+        edges.push_back(*edge_id);
+        vertex = graph_.GetEdge(*edge_id).from;
       }
+      std::reverse(std::begin(edges), std::end(edges));
+      return vertex;
     }
 
-    void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
-      for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
-        if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
-          for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
-            if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
-              RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
-            }
-          }
-        }
+    std::optional<Weight> ExpandRouteOnDemand(VertexId from, VertexId to, ExpandedRoute& edges) const {
+      const auto& search_space = SearchOnDemand(from, [to](VertexId vertex, const Weight&) { return vertex == to; });
+      if (!search_space.routes[to]) {
+        return std::nullopt;
       }
+      UnrollSearchRoute(search_space, to, edges);
+      return search_space.routes[to]->weight;
     }
 
-    RoutesInternalData routes_internal_data_;
+    std::optional<FloydWarshall<Weight>> all_pairs_;
+    std::optional<RouteTable<Weight>> route_table_;
+    std::optional<ContractionHierarchy<Weight>> hierarchy_;
   };
 
 
   template <typename Weight>
-  Router<Weight>::Router(const Graph& graph)
+  Router<Weight>::Router(const Graph& graph, RouterMode mode, size_t thread_count,
+                         std::vector<VertexId> sources)
       : graph_(graph),
-        routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+        mode_(mode)
   {
-    InitializeRoutesInternalData(graph);
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      all_pairs_.emplace(graph, thread_count);
+    }
+    if (mode_ == RouterMode::ALL_PAIRS_COMPACT) {
+      if (sources.empty()) {
+        sources.resize(graph.GetVertexCount());
+        std::iota(std::begin(sources), std::end(sources), 0);
+      }
+      route_table_.emplace(graph, sources, thread_count);
+    }
+    if (mode_ == RouterMode::CONTRACTION_HIERARCHY) {
+      hierarchy_.emplace(graph);
+    }
+  }
 
-    const size_t vertex_count = graph.GetVertexCount();
-    for (VertexId vertex_through = 0; vertex_through < vertex_count; ++vertex_through) {
-      RelaxRoutesInternalDataThroughVertex(vertex_count, vertex_through);
+  template <typename Weight>
+  template <typename Reader>
+  Router<Weight>::Router(const Graph& graph, Reader& reader)
+      : graph_(graph),
+        mode_(reader.template Read<RouterMode>())
+  {
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      all_pairs_ = FloydWarshall<Weight>::Load(reader);
+    }
+    if (mode_ == RouterMode::ALL_PAIRS_COMPACT) {
+      route_table_ = RouteTable<Weight>::Load(reader);
+    }
+    if (mode_ == RouterMode::CONTRACTION_HIERARCHY) {
+      hierarchy_ = ContractionHierarchy<Weight>::Load(reader);
     }
   }
 
   template <typename Weight>
-  std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
-    const auto& route_internal_data = routes_internal_data_[from][to];
-    if (!route_internal_data) {
+  template <typename Writer>
+  void Router<Weight>::Save(Writer& writer) const {
+    writer.Write(mode_);
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      all_pairs_->Save(writer);
+    }
+    if (mode_ == RouterMode::ALL_PAIRS_COMPACT) {
+      route_table_->Save(writer);
+    }
+    if (mode_ == RouterMode::CONTRACTION_HIERARCHY) {
+      hierarchy_->Save(writer);
+    }
+  }
+
+  template <typename Weight>
+  RouterMode Router<Weight>::GetMode() const {
+    return mode_;
+  }
+
+  template <typename Weight>
+  std::optional<Weight> Router<Weight>::FindRoute(VertexId from, VertexId to, std::vector<EdgeId>& edges) const {
+    edges.clear();
+    switch (mode_) {
+    case RouterMode::ALL_PAIRS:
+      return all_pairs_->FindRoute(graph_, from, to, edges);
+    case RouterMode::ALL_PAIRS_COMPACT:
+      if (route_table_->HasSource(from)) {
+        return route_table_->FindRoute(graph_, from, to, edges);
+      }
+      return ExpandRouteOnDemand(from, to, edges);
+    case RouterMode::CONTRACTION_HIERARCHY:
+      return hierarchy_->FindRoute(from, to, edges);
+    default:
+      return ExpandRouteOnDemand(from, to, edges);
+    }
+  }
+
+  template <typename Weight>
+  std::vector<std::optional<Weight>> Router<Weight>::FindRouteWeights(VertexId from,
+                                                                      const std::vector<VertexId>& targets) const {
+    std::vector<std::optional<Weight>> weights;
+    weights.reserve(targets.size());
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      for (const VertexId to : targets) {
+        weights.push_back(all_pairs_->FindRouteWeight(from, to));
+      }
+      return weights;
+    }
+    if (mode_ == RouterMode::ALL_PAIRS_COMPACT && route_table_->HasSource(from)) {
+      std::vector<EdgeId> edges;
+      for (const VertexId to : targets) {
+        edges.clear();
+        weights.push_back(route_table_->FindRoute(graph_, from, to, edges));
+      }
+      return weights;
+    }
+
+    // The hierarchy only answers point-to-point queries, so it searches the original graph too
+    std::vector<VertexId> pending = targets;
+    std::sort(std::begin(pending), std::end(pending));
+    pending.erase(std::unique(std::begin(pending), std::end(pending)), std::end(pending));
+    const auto& routes = SearchOnDemand(from, [&pending](VertexId vertex, const Weight&) {
+      const auto it = std::lower_bound(std::begin(pending), std::end(pending), vertex);
+      if (it != std::end(pending) && *it == vertex) {
+        pending.erase(it);
+      }
+      return pending.empty();
+    }).routes;
+    for (const VertexId to : targets) {
+      weights.push_back(routes[to] ? std::optional<Weight>(routes[to]->weight) : std::nullopt);
+    }
+    return weights;
+  }
+
+  template <typename Weight>
+  std::vector<std::pair<VertexId, Weight>> Router<Weight>::FindReachable(VertexId from,
+                                                                         const Weight& max_weight) const {
+    std::vector<std::pair<VertexId, Weight>> reached;
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      for (VertexId to = 0; to < graph_.GetVertexCount(); ++to) {
+        const auto weight = all_pairs_->FindRouteWeight(from, to);
+        if (weight && !(max_weight < *weight)) {
+          reached.emplace_back(to, *weight);
+        }
+      }
+      std::stable_sort(std::begin(reached), std::end(reached), [](const auto& lhs, const auto& rhs) {
+        return lhs.second < rhs.second;
+      });
+      return reached;
+    }
+
+    SearchOnDemand(from, [&](VertexId vertex, const Weight& weight) {
+      if (max_weight < weight) {
+        return true;
+      }
+      reached.emplace_back(vertex, weight);
+      return false;
+    });
+    return reached;
+  }
+
+  template <typename Weight>
+  std::optional<typename Router<Weight>::OverlayRoute> Router<Weight>::FindOverlayRoute(
+      const std::vector<Endpoint>& sources, const std::vector<Endpoint>& targets,
+      std::vector<EdgeId>& edges) const {
+    edges.clear();
+    std::optional<OverlayRoute> best;
+    if (mode_ == RouterMode::ALL_PAIRS) {
+      for (size_t source_idx = 0; source_idx < sources.size(); ++source_idx) {
+        for (size_t target_idx = 0; target_idx < targets.size(); ++target_idx) {
+          const auto weight = all_pairs_->FindRouteWeight(sources[source_idx].vertex, targets[target_idx].vertex);
+          if (!weight) {
+            continue;
+          }
+          const Weight total_weight = sources[source_idx].weight + *weight + targets[target_idx].weight;
+          if (!best || total_weight < best->weight) {
+            best = OverlayRoute{total_weight, source_idx, target_idx};
+          }
+        }
+      }
+      if (best) {
+        all_pairs_->FindRoute(graph_, sources[best->source_idx].vertex, targets[best->target_idx].vertex, edges);
+      }
+      return best;
+    }
+
+    // Every other mode runs one search from all the sources at once. Targets are settled
+    // in order of their graph weight, so the search stops at the first vertex no lighter
+    // than the best route found, exit weight included.
+    std::vector<size_t> target_order(targets.size());
+    std::iota(std::begin(target_order), std::end(target_order), 0);
+    std::sort(std::begin(target_order), std::end(target_order), [&targets](size_t lhs, size_t rhs) {
+      return targets[lhs].vertex < targets[rhs].vertex;
+    });
+    const auto& search_space = SearchOnDemand(sources.data(), sources.size(), [&](VertexId vertex, const Weight& weight) {
+      if (best && !(weight < best->weight)) {
+        return true;
+      }
+      auto it = std::lower_bound(std::begin(target_order), std::end(target_order), vertex,
+                                 [&targets](size_t target_idx, VertexId vertex) {
+                                   return targets[target_idx].vertex < vertex;
+                                 });
+      for (; it != std::end(target_order) && targets[*it].vertex == vertex; ++it) {
+        const Weight total_weight = weight + targets[*it].weight;
+        if (!best || total_weight < best->weight) {
+          best = OverlayRoute{total_weight, 0, *it};
+        }
+      }
+      return false;
+    });
+    if (!best) {
       return std::nullopt;
     }
-    const Weight weight = route_internal_data->weight;
+
+    // Several sources may share the start vertex; the lightest of them is the one used
+    const VertexId start = UnrollSearchRoute(search_space, targets[best->target_idx].vertex, edges);
+    std::optional<size_t> source_idx;
+    for (size_t idx = 0; idx < sources.size(); ++idx) {
+      if (sources[idx].vertex == start && (!source_idx || sources[idx].weight < sources[*source_idx].weight)) {
+        source_idx = idx;
+      }
+    }
+    best->source_idx = *source_idx;
+    return best;
+  }
+
+  template <typename Weight>
+  std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
     std::vector<EdgeId> edges;
-    for (std::optional<EdgeId> edge_id = route_internal_data->prev_edge;
-         edge_id;
-         edge_id = routes_internal_data_[from][graph_.GetEdge(*edge_id).from]->prev_edge) {
-      edges.push_back(*edge_id);
+    const std::optional<Weight> weight = FindRoute(from, to, edges);
+    if (!weight) {
+      return std::nullopt;
     }
-    std::reverse(std::begin(edges), std::end(edges));
 
-    const RouteId route_id = next_route_id_++;
     const size_t route_edge_count = edges.size();
+    std::lock_guard<std::mutex> lock(expanded_routes_mutex_);
+    const RouteId route_id = next_route_id_++;
     expanded_routes_cache_[route_id] = std::move(edges);
-    return RouteInfo{route_id, weight, route_edge_count};
+    return RouteInfo{route_id, *weight, route_edge_count};
   }
 
   template <typename Weight>
   EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+    std::lock_guard<std::mutex> lock(expanded_routes_mutex_);
     return expanded_routes_cache_.at(route_id)[edge_idx];
   }
 
   template <typename Weight>
   void Router<Weight>::ReleaseRoute(RouteId route_id) {
+    std::lock_guard<std::mutex> lock(expanded_routes_mutex_);
     expanded_routes_cache_.erase(route_id);
   }
 
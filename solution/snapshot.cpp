@@ -0,0 +1,163 @@
+#include "snapshot.h"
+
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace Snapshot {
+
+  namespace {
+    const char MAGIC[8] = {'T', 'M', 'S', 'N', 'A', 'P', '\0', '\0'};
+    const size_t ALIGNMENT = 8;
+
+    struct Header {
+      char magic[8];
+      uint32_t version;
+      uint32_t reserved;
+      uint64_t payload_size;
+      uint64_t checksum;
+    };
+
+    const uint64_t CHECKSUM_SEED = 0xcbf29ce484222325ULL;
+
+    // FNV-style mixing over 64-bit words; the payload is always a whole number of words
+    uint64_t UpdateChecksum(uint64_t checksum, const char* data, size_t size) {
+      for (size_t offset = 0; offset < size; offset += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + offset, sizeof(word));
+        checksum = (checksum ^ word) * 0x100000001b3ULL;
+      }
+      return checksum;
+    }
+  }
+
+  Writer::Writer(const string& path)
+      : path_(path),
+        output_(fopen(path.c_str(), "wb")),
+        checksum_(CHECKSUM_SEED) {
+    if (!output_) {
+      throw runtime_error("Cannot open " + path);
+    }
+    const Header placeholder{};
+    fwrite(&placeholder, sizeof(placeholder), 1, output_);
+  }
+
+  Writer::~Writer() {
+    if (output_) {
+      fclose(output_);
+    }
+  }
+
+  void Writer::WriteBytes(const void* data, size_t size) {
+    // Empty arrays and strings may have no storage at all
+    if (size == 0) {
+      return;
+    }
+    static const char padding[ALIGNMENT] = {};
+    const size_t padded_size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    const size_t aligned_size = size / ALIGNMENT * ALIGNMENT;
+
+    const char* bytes = static_cast<const char*>(data);
+    checksum_ = UpdateChecksum(checksum_, bytes, aligned_size);
+    if (aligned_size < padded_size) {
+      char tail[ALIGNMENT] = {};
+      memcpy(tail, bytes + aligned_size, size - aligned_size);
+      checksum_ = UpdateChecksum(checksum_, tail, ALIGNMENT);
+    }
+
+    fwrite(bytes, 1, size, output_);
+    fwrite(padding, 1, padded_size - size, output_);
+    payload_size_ += padded_size;
+  }
+
+  void Writer::WriteString(string_view str) {
+    Write(static_cast<uint64_t>(str.size()));
+    WriteBytes(str.data(), str.size());
+  }
+
+  void Writer::Finish() {
+    Header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = FORMAT_VERSION;
+    header.payload_size = payload_size_;
+    header.checksum = checksum_;
+
+    fseek(output_, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, output_);
+    const bool failed = ferror(output_) != 0;
+    fclose(output_);
+    output_ = nullptr;
+    if (failed) {
+      throw runtime_error("Cannot write " + path_);
+    }
+  }
+
+  Reader::Reader(const string& path)
+      : path_(path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw runtime_error("Cannot open " + path);
+    }
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < sizeof(Header)) {
+      close(fd);
+      ThrowCorrupted();
+    }
+    mapped_size_ = file_stat.st_size;
+    void* data = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+      throw runtime_error("Cannot map " + path);
+    }
+    data_ = static_cast<const char*>(data);
+
+    Header header;
+    memcpy(&header, data_, sizeof(header));
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+      munmap(data, mapped_size_);
+      throw runtime_error("Not a snapshot: " + path);
+    }
+    if (header.version != FORMAT_VERSION) {
+      munmap(data, mapped_size_);
+      throw runtime_error("Unsupported snapshot version " + to_string(header.version) + ": " + path);
+    }
+    if (header.payload_size != mapped_size_ - sizeof(Header) ||
+        UpdateChecksum(CHECKSUM_SEED, data_ + sizeof(Header), header.payload_size) != header.checksum) {
+      munmap(data, mapped_size_);
+      ThrowCorrupted();
+    }
+    offset_ = sizeof(Header);
+  }
+
+  Reader::~Reader() {
+    munmap(const_cast<char*>(data_), mapped_size_);
+  }
+
+  const char* Reader::ReadBytes(size_t size) {
+    const size_t padded_size = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    if (padded_size > mapped_size_ - offset_) {
+      ThrowCorrupted();
+    }
+    const char* bytes = data_ + offset_;
+    offset_ += padded_size;
+    return bytes;
+  }
+
+  string_view Reader::ReadString() {
+    const uint64_t size = Read<uint64_t>();
+    if (size > mapped_size_ - offset_) {
+      ThrowCorrupted();
+    }
+    return {ReadBytes(size), size};
+  }
+
+  void Reader::ThrowCorrupted() const {
+    throw runtime_error("Corrupted snapshot: " + path_);
+  }
+}
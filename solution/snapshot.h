@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Binary snapshot of a built transport database. The file is a fixed header (magic,
+// format version, payload size and checksum) followed by a payload of trivially
+// copyable values and arrays, each padded to 8 bytes so that the checksum can run
+// over whole words. Values are stored in native byte order, so the types written must
+// have no padding bytes: their contents would make the file differ from build to build.
+namespace Snapshot {
+
+  const uint32_t FORMAT_VERSION = 5;
+
+  class Writer {
+  public:
+    explicit Writer(const std::string& path);
+    Writer(const Writer&) = delete;
+    Writer& operator = (const Writer&) = delete;
+    ~Writer();
+
+    template <typename T>
+    void Write(const T& value) {
+      static_assert(std::is_trivially_copyable_v<T>);
+      WriteBytes(&value, sizeof(value));
+    }
+
+    template <typename T, typename Allocator>
+    void WriteArray(const std::vector<T, Allocator>& values) {
+      static_assert(std::is_trivially_copyable_v<T>);
+      Write(static_cast<uint64_t>(values.size()));
+      WriteBytes(values.data(), values.size() * sizeof(T));
+    }
+
+    void WriteString(std::string_view str);
+
+    // Writes the header; the snapshot is incomplete until this is called
+    void Finish();
+
+  private:
+    void WriteBytes(const void* data, size_t size);
+
+    std::string path_;
+    FILE* output_;
+    uint64_t payload_size_ = 0;
+    uint64_t checksum_;
+  };
+
+  // Maps the whole file, and validates the header and checksum before anything is read
+  class Reader {
+  public:
+    explicit Reader(const std::string& path);
+    Reader(const Reader&) = delete;
+    Reader& operator = (const Reader&) = delete;
+    ~Reader();
+
+    template <typename T>
+    T Read() {
+      static_assert(std::is_trivially_copyable_v<T>);
+      T value;
+      std::memcpy(&value, ReadBytes(sizeof(T)), sizeof(T));
+      return value;
+    }
+
+    template <typename T, typename Allocator = std::allocator<T>>
+    std::vector<T, Allocator> ReadArray() {
+      static_assert(std::is_trivially_copyable_v<T>);
+      const uint64_t count = Read<uint64_t>();
+      if (count > (mapped_size_ - offset_) / sizeof(T)) {
+        ThrowCorrupted();
+      }
+      std::vector<T, Allocator> values(count);
+      if (count == 0) {
+        return values;
+      }
+      std::memcpy(values.data(), ReadBytes(count * sizeof(T)), count * sizeof(T));
+      return values;
+    }
+
+    std::string_view ReadString();
+
+  private:
+    const char* ReadBytes(size_t size);
+    [[noreturn]] void ThrowCorrupted() const;
+
+    std::string path_;
+    const char* data_ = nullptr;
+    size_t mapped_size_ = 0;
+    size_t offset_ = 0;
+  };
+}
@@ -0,0 +1,110 @@
+#include "stop_index.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace {
+	double SquaredDistance(const StopIndex::Point& lhs, const StopIndex::Point& rhs) {
+		double result = 0.0;
+		for (size_t axis = 0; axis < 3; ++axis) {
+			const double delta = lhs[axis] - rhs[axis];
+			result += delta * delta;
+		}
+		return result;
+	}
+}
+
+StopIndex::StopIndex(const vector<Point>& points) {
+	nodes_.reserve(points.size());
+	for (StopId stop_id = 0; stop_id < points.size(); ++stop_id) {
+		nodes_.push_back({ points[stop_id], stop_id, 0 });
+	}
+	Build(0, nodes_.size());
+}
+
+void StopIndex::Build(size_t begin, size_t end) {
+	if (end - begin <= 1) {
+		return;
+	}
+
+	Point low = nodes_[begin].point;
+	Point high = low;
+	for (size_t idx = begin + 1; idx < end; ++idx) {
+		for (size_t axis = 0; axis < 3; ++axis) {
+			low[axis] = min(low[axis], nodes_[idx].point[axis]);
+			high[axis] = max(high[axis], nodes_[idx].point[axis]);
+		}
+	}
+	uint8_t axis = 0;
+	for (uint8_t candidate = 1; candidate < 3; ++candidate) {
+		if (high[candidate] - low[candidate] > high[axis] - low[axis]) {
+			axis = candidate;
+		}
+	}
+
+	const size_t middle = begin + (end - begin) / 2;
+	nth_element(nodes_.begin() + begin, nodes_.begin() + middle, nodes_.begin() + end,
+							[axis](const Node& lhs, const Node& rhs) { return lhs.point[axis] < rhs.point[axis]; });
+	nodes_[middle].axis = axis;
+	Build(begin, middle);
+	Build(middle + 1, end);
+}
+
+// heap keeps the best count candidates found so far, the farthest one on top
+void StopIndex::Search(size_t begin, size_t end, const Point& target, size_t count,
+											 vector<Candidate>& heap) const {
+	if (begin >= end) {
+		return;
+	}
+	const size_t middle = begin + (end - begin) / 2;
+	const Node& node = nodes_[middle];
+
+	const Candidate candidate{ SquaredDistance(node.point, target), node.stop_id };
+	if (heap.size() < count || candidate < heap.front()) {
+		heap.push_back(candidate);
+		push_heap(heap.begin(), heap.end());
+		if (heap.size() > count) {
+			pop_heap(heap.begin(), heap.end());
+			heap.pop_back();
+		}
+	}
+
+	const double delta = target[node.axis] - node.point[node.axis];
+	const bool is_left_nearer = delta < 0;
+	if (is_left_nearer) {
+		Search(begin, middle, target, count, heap);
+	}
+	else {
+		Search(middle + 1, end, target, count, heap);
+	}
+	// The far side can only help if the splitting plane is closer than the worst candidate
+	if (heap.size() < count || delta * delta <= heap.front().first) {
+		if (is_left_nearer) {
+			Search(middle + 1, end, target, count, heap);
+		}
+		else {
+			Search(begin, middle, target, count, heap);
+		}
+	}
+}
+
+vector<pair<StopIndex::StopId, double>> StopIndex::FindNearest(const Point& target, size_t count) const {
+	// The count comes from the request, so it is bounded by what the index can return
+	count = min(count, nodes_.size());
+	if (count == 0) {
+		return {};
+	}
+	vector<Candidate> heap;
+	heap.reserve(count + 1);
+	Search(0, nodes_.size(), target, count, heap);
+	sort_heap(heap.begin(), heap.end());
+
+	vector<pair<StopId, double>> nearest;
+	nearest.reserve(heap.size());
+	for (const auto& [squared_distance, stop_id] : heap) {
+		nearest.emplace_back(stop_id, sqrt(squared_distance));
+	}
+	return nearest;
+}
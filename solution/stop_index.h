@@ -0,0 +1,40 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// k-d tree over stop positions as unit vectors in 3D. The straight-line (chord) distance
+// between two unit vectors grows monotonically with the great-circle distance between the
+// points, so the nearest stops by chord are the nearest on the sphere; the search itself
+// needs no trigonometry. Nodes are laid out implicitly: the root of the subtree over
+// [begin, end) is the middle element, split on the axis of the widest spread.
+class StopIndex {
+public:
+	using StopId = uint32_t;
+	using Point = std::array<double, 3>;
+
+	StopIndex() = default;
+	// Indexed by StopId
+	explicit StopIndex(const std::vector<Point>& points);
+
+	// Up to count stops ordered by distance, each with its chord length on the unit sphere
+	std::vector<std::pair<StopId, double>> FindNearest(const Point& target, size_t count) const;
+
+private:
+	struct Node {
+		Point point;
+		StopId stop_id;
+		uint8_t axis;
+	};
+
+	using Candidate = std::pair<double, StopId>;
+
+	void Build(size_t begin, size_t end);
+	void Search(size_t begin, size_t end, const Point& target, size_t count,
+							std::vector<Candidate>& heap) const;
+
+	std::vector<Node> nodes_;
+};
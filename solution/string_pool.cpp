@@ -0,0 +1,19 @@
+#include "string_pool.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+string_view StringPool::Add(string_view str) {
+	if (block_used_ + str.size() > block_capacity_) {
+		block_capacity_ = max(BLOCK_SIZE, str.size());
+		blocks_.push_back(make_unique<char[]>(block_capacity_));
+		block_used_ = 0;
+	}
+
+	char* data = blocks_.back().get() + block_used_;
+	memcpy(data, str.data(), str.size());
+	block_used_ += str.size();
+	return { data, str.size() };
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// Append-only storage for names. Strings are packed back to back into large blocks
+// that never move, so returned views stay valid for the lifetime of the pool,
+// including after the pool itself is moved.
+class StringPool {
+public:
+	std::string_view Add(std::string_view str);
+
+private:
+	static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+	std::vector<std::unique_ptr<char[]>> blocks_;
+	size_t block_used_ = 0;
+	size_t block_capacity_ = 0;
+};
@@ -1,5 +1,6 @@
 #include "transport_manager.h"
 
+#include <algorithm>
 #include <cmath>
 #include <tuple>
 #include <unordered_set>
@@ -12,21 +13,94 @@ const double EARTH_RADIUS = 6371'000.0;
 
 // GeoCoordinates
 
+namespace {
+	array<double, 3> ToUnitVector(double sin_latitude, double cos_latitude, double longitude) {
+		return { cos_latitude * cos(longitude), cos_latitude * sin(longitude), sin_latitude };
+	}
+
+	// Arc length for a chord of the unit sphere; exact, and stable for coincident points
+	double ChordToDistance(double chord) {
+		return 2.0 * asin(min(chord / 2.0, 1.0)) * EARTH_RADIUS;
+	}
+}
+
 GeoCoordinates::GeoCoordinates(double latitude_degree, double longitude_degree)
 	: latitude_(ToRadian(latitude_degree)),
-	longitude_(ToRadian(longitude_degree)) {}
+	longitude_(ToRadian(longitude_degree)),
+	sin_latitude_(sin(latitude_)),
+	cos_latitude_(cos(latitude_)),
+	unit_vector_(ToUnitVector(sin_latitude_, cos_latitude_, longitude_)) {}
+
+GeoCoordinates GeoCoordinates::FromRadian(double latitude, double longitude) {
+	GeoCoordinates coords(0.0, 0.0);
+	coords.latitude_ = latitude;
+	coords.longitude_ = longitude;
+	coords.sin_latitude_ = sin(latitude);
+	coords.cos_latitude_ = cos(latitude);
+	coords.unit_vector_ = ToUnitVector(coords.sin_latitude_, coords.cos_latitude_, longitude);
+	return coords;
+}
 
 double GeoCoordinates::ToRadian(double degree) {
 	return degree * (PI / 180.0);
 }
 
+double GeoCoordinates::ToDegree(double radian) {
+	return radian * (180.0 / PI);
+}
+
 double ComputeDistanceForCoords(const GeoCoordinates& lhs, const GeoCoordinates& rhs) {
-	const double arc_distance = 
-		sin(lhs.latitude_) * sin(rhs.latitude_) +
-		cos(lhs.latitude_) * cos(rhs.latitude_) *
+	const double arc_distance =
+		lhs.sin_latitude_ * rhs.sin_latitude_ +
+		lhs.cos_latitude_ * rhs.cos_latitude_ *
 		cos(lhs.longitude_ - rhs.longitude_);
 
-	return acos(arc_distance) * EARTH_RADIUS;
+	// Rounding may push coincident points just past 1
+	return acos(min(arc_distance, 1.0)) * EARTH_RADIUS;
+}
+
+double ComputeStableDistanceForCoords(const GeoCoordinates& lhs, const GeoCoordinates& rhs) {
+	double squared_chord = 0.0;
+	for (size_t axis = 0; axis < 3; ++axis) {
+		const double delta = lhs.unit_vector_[axis] - rhs.unit_vector_[axis];
+		squared_chord += delta * delta;
+	}
+	return ChordToDistance(sqrt(squared_chord));
+}
+
+vector<GeoCoordinates> ComputeConvexHull(vector<GeoCoordinates> points) {
+	sort(points.begin(), points.end(), [](const GeoCoordinates& lhs, const GeoCoordinates& rhs) {
+		return tie(lhs.longitude_, lhs.latitude_) < tie(rhs.longitude_, rhs.latitude_);
+	});
+	points.erase(unique(points.begin(), points.end(), [](const GeoCoordinates& lhs, const GeoCoordinates& rhs) {
+		return lhs.longitude_ == rhs.longitude_ && lhs.latitude_ == rhs.latitude_;
+	}), points.end());
+	if (points.size() < 3) {
+		return points;
+	}
+
+	// Andrew's monotone chain: the lower chain west to east, then the upper one back
+	auto turns_left = [](const GeoCoordinates& a, const GeoCoordinates& b, const GeoCoordinates& c) {
+		return (b.longitude_ - a.longitude_) * (c.latitude_ - a.latitude_) -
+			(b.latitude_ - a.latitude_) * (c.longitude_ - a.longitude_) > 0;
+	};
+	vector<GeoCoordinates> hull;
+	hull.reserve(points.size() + 1);
+	for (size_t idx = 0; idx < points.size(); ++idx) {
+		while (hull.size() >= 2 && !turns_left(hull[hull.size() - 2], hull.back(), points[idx])) {
+			hull.pop_back();
+		}
+		hull.push_back(points[idx]);
+	}
+	const size_t lower_size = hull.size();
+	for (size_t idx = points.size() - 1; idx-- > 0;) {
+		while (hull.size() > lower_size && !turns_left(hull[hull.size() - 2], hull.back(), points[idx])) {
+			hull.pop_back();
+		}
+		hull.push_back(points[idx]);
+	}
+	hull.pop_back();
+	return hull;
 }
 // GeoCoordinates end
 
@@ -55,12 +129,13 @@ EdgeWeight operator + (const EdgeWeight& lhs, const EdgeWeight& rhs) {
 	return EdgeWeight(lhs).operator+=(rhs);
 }
 
-TransportManager::RoutingSettings::RoutingSettings(int wait, double velocity_in_kmph)
-	: wait_time(wait), velocity(velocity_in_kmph / 60.0) {}
+TransportManager::RoutingSettings::RoutingSettings(int wait, double velocity_in_kmph, double pedestrian_velocity_in_kmph)
+	: wait_time(wait), velocity(velocity_in_kmph / 60.0), pedestrian_velocity(pedestrian_velocity_in_kmph / 60.0) {}
 
-TransportManager::TransportManager(size_t stops_count, int bus_wait_time, double bus_velocity_in_kmph)
+TransportManager::TransportManager(size_t stops_count, int bus_wait_time, double bus_velocity_in_kmph,
+																	 double pedestrian_velocity_in_kmph)
 	: graph(stops_count),
-		settings( bus_wait_time, bus_velocity_in_kmph )
+		settings( bus_wait_time, bus_velocity_in_kmph, pedestrian_velocity_in_kmph )
 {}
 
 double TransportManager::Distance::Curvature() const {
@@ -70,93 +145,291 @@ double TransportManager::Distance::Curvature() const {
 
 
 
-TransportManager::ConstStopRawPtr TransportManager::SetStop(string stop_id, TransportManager::Stop stop) {
-	auto [it, is_inserted] = stops_.emplace(std::move(stop_id), std::move(stop));
-	return &(*it);
+TransportManager::StopId TransportManager::AddStop(string_view name, GeoCoordinates coords, Graph::VertexId vertex_id) {
+	if (auto it = stop_ids_.find(name); it != stop_ids_.end()) {
+		return it->second;
+	}
+	const StopId id = stops_.size();
+	stops_.push_back({ names_->Add(name), coords, {}, vertex_id });
+	stop_ids_.emplace(stops_.back().name_, id);
+
+	if (vertex_stops_.size() < vertex_id + 2) {
+		vertex_stops_.resize(vertex_id + 2);
+	}
+	vertex_stops_[vertex_id] = vertex_stops_[vertex_id + 1] = id;
+	return id;
 }
 
-TransportManager::StopRawPtr TransportManager::GetStop(const std::string& stop_id) {
-	if (auto it = stops_.find(stop_id); it != stops_.end()) {
-		return &(*it);
+const TransportManager::Stop* TransportManager::GetStop(string_view name) const {
+	if (auto it = stop_ids_.find(name); it != stop_ids_.end()) {
+		return &stops_[it->second];
 	}
 	return nullptr;
 }
 
-TransportManager::ConstStopRawPtr TransportManager::GetStop(const string& stop_id) const {
-	if (auto it = stops_.find(stop_id); it != stops_.end()) {
-		return &(*it);
+const TransportManager::Stop& TransportManager::GetStop(StopId id) const {
+	return stops_[id];
+}
+
+optional<TransportManager::StopId> TransportManager::FindStopId(string_view name) const {
+	if (auto it = stop_ids_.find(name); it != stop_ids_.end()) {
+		return it->second;
 	}
-	return nullptr;
+	return nullopt;
 }
 
+size_t TransportManager::GetStopCount() const {
+	return stops_.size();
+}
 
-TransportManager::ConstStopRawPtr TransportManager::GetStopByVertexId(Graph::VertexId id) const {
-	return vertex_id_to_stop.at(id);
+vector<TransportManager::NearbyStop> TransportManager::FindNearestStops(const GeoCoordinates& coords, size_t count) const {
+	vector<NearbyStop> nearest;
+	for (const auto& [stop_id, chord] : stop_index_.FindNearest(coords.unit_vector_, count)) {
+		nearest.push_back({ stop_id, ChordToDistance(chord) });
+	}
+	return nearest;
 }
-Graph::VertexId TransportManager::GetVertexIdByStop(const std::string& stop_id) const {
-	return stop_to_vertex_id.at(GetStop(stop_id));
+
+void TransportManager::BuildStopIndex() {
+	vector<StopIndex::Point> points;
+	points.reserve(stops_.size());
+	for (const Stop& stop : stops_) {
+		points.push_back(stop.coords_.unit_vector_);
+	}
+	stop_index_ = StopIndex(points);
 }
 
-Graph::VertexId TransportManager::GetVertexIdByWaitStop(const std::string& stop_id) const {
-	return wait_stop_to_vertex_id.at(GetStop(stop_id));
+TransportManager::BusId TransportManager::AddBus(string_view name, Bus::Type type) {
+	if (auto it = bus_ids_.find(name); it != bus_ids_.end()) {
+		return it->second;
+	}
+	const BusId id = buses_.size();
+	buses_.push_back({ names_->Add(name), type, {}, {} });
+	bus_ids_.emplace(buses_.back().name_, id);
+	return id;
 }
 
-const TransportManager::EdgeInfo& TransportManager::GetEdgeInfoByEdgeId(Graph::EdgeId id) const {
-	return edge_id_to_info.at(id);
+const TransportManager::Bus* TransportManager::GetBus(string_view name) const {
+	if (auto it = bus_ids_.find(name); it != bus_ids_.end()) {
+		return &buses_[it->second];
+	}
+	return nullptr;
 }
 
+const TransportManager::Bus& TransportManager::GetBus(BusId id) const {
+	return buses_[id];
+}
 
-TransportManager::BusRawPtr TransportManager::SetBus(string bus_id, TransportManager::Bus info) {
-	auto [it, is_inserted] = buses_.emplace(std::move(bus_id), std::move(info));
-	return &(*it);
+Graph::VertexId TransportManager::GetVertexIdByStop(StopId id) const {
+	return stops_[id].vertex_id_;
 }
 
-TransportManager::ConstBusRawPtr TransportManager::GetBus(const string& bus_id) const {
-	if (auto it = buses_.find(bus_id); it != buses_.end()) {
-		return &(*it);
+Graph::VertexId TransportManager::GetVertexIdByWaitStop(StopId id) const {
+	return stops_[id].vertex_id_ + 1;
+}
+
+Graph::VertexId TransportManager::GetVertexIdByWaitStop(string_view name) const {
+	if (const auto id = FindStopId(name)) {
+		return GetVertexIdByWaitStop(*id);
 	}
-	return nullptr;
+	throw invalid_argument("Valid stop expected: " + string(name));
+}
+
+const TransportManager::Stop& TransportManager::GetStopByVertexId(Graph::VertexId id) const {
+	return stops_[vertex_stops_[id]];
 }
 
-TransportManager::Distance TransportManager::ComputeDistanceForStop(const string& bus_id) const {
-	auto bus_it = buses_.find(bus_id);
-	if (bus_it == buses_.end()) {
-		return { 0.0, 0.0};
+const TransportManager::Stop* TransportManager::FindStopByWaitVertex(Graph::VertexId id) const {
+	if (id >= vertex_stops_.size() || GetVertexIdByWaitStop(vertex_stops_[id]) != id) {
+		return nullptr;
 	}
+	return &stops_[vertex_stops_[id]];
+}
+
+const TransportManager::EdgeInfo& TransportManager::GetEdgeInfoByEdgeId(Graph::EdgeId id) const {
+	return edge_info_[id];
+}
+
+Graph::EdgeId TransportManager::AddEdge(const Graph::Edge<EdgeWeight>& edge) {
+	return AddEdge(edge, EdgeInfo());
+}
+
+Graph::EdgeId TransportManager::AddEdge(const Graph::Edge<EdgeWeight>& edge, EdgeInfo info) {
+	const Graph::EdgeId edge_id = graph.AddEdge(edge);
+	edge_info_.push_back(info);
+	return edge_id;
+}
 
-	
-	optional<ConstStopRawPtr> last;
+TransportManager::Distance TransportManager::ComputeDistanceForBus(const Bus& bus) const {
+	optional<StopId> last;
 	Distance dist;
 
-	for (auto stop_ptr : bus_it->second.stops_) {
+	for (StopId stop_id : bus.stops_) {
 		if (last) {
 			const double raw_distance =
-				ComputeDistanceForCoords((*last)->second.coords_, stop_ptr->second.coords_);
+				ComputeDistanceForCoords(stops_[*last].coords_, stops_[stop_id].coords_);
 			dist.raw_ += raw_distance;
-			dist.by_default_ += GetDistance((*last)->first, stop_ptr->first);
+			dist.by_default_ += GetDistance(*last, stop_id);
 
-			if (bus_it->second.type_ == Bus::Type::REGULAR) {
+			if (bus.type_ == Bus::Type::REGULAR) {
 				dist.raw_ += raw_distance;
-				dist.by_default_ += GetDistance(stop_ptr->first, (*last)->first);
+				dist.by_default_ += GetDistance(stop_id, *last);
 			}
 		}
-		last = stop_ptr;
+		last = stop_id;
 	}
 	return dist;
 }
 
-double TransportManager::GetDistance(const string& from, const string& to) const {
-	auto from_it = stops_.find(from);
-	auto to_it = stops_.find(to);
-	if (from_it == stops_.end() || to_it == stops_.end()) {
-		throw invalid_argument("Valid stops expected: " + from + "&&" + to);
+TransportManager::BusStats TransportManager::ComputeBusStats(const Bus& bus) const {
+	BusStats stats;
+	stats.length_ = ComputeDistanceForBus(bus);
+	stats.stop_count_ = bus.type_ == Bus::Type::REGULAR ?
+		bus.stops_.size() * 2 - 1 :
+		bus.stops_.size();
+	stats.unique_stop_count_ = unordered_set<StopId>(bus.stops_.begin(), bus.stops_.end()).size();
+	return stats;
+}
+
+void TransportManager::SetDistance(StopId from, StopId to, double distance) {
+	distances_.Set(from, to, distance);
+}
+
+double TransportManager::GetDistance(StopId from, StopId to) const {
+	if (const auto distance = distances_.Find(from, to)) {
+		return *distance;
+	}
+	return ComputeDistanceForCoords(stops_[from].coords_, stops_[to].coords_);
+}
+
+void TransportManager::Save(Snapshot::Writer& writer) const {
+	writer.Write(settings.wait_time);
+	writer.Write(settings.velocity);
+	writer.Write(settings.pedestrian_velocity);
+	writer.Write(graph_model_);
+
+	string names;
+	vector<uint32_t> stop_name_sizes, bus_name_sizes;
+	vector<double> stop_coords;
+	vector<Graph::VertexId> stop_vertex_ids;
+	vector<uint32_t> stop_bus_offsets = { 0 };
+	vector<BusId> stop_buses;
+	for (const Stop& stop : stops_) {
+		names += stop.name_;
+		stop_name_sizes.push_back(stop.name_.size());
+		stop_coords.push_back(stop.coords_.latitude_);
+		stop_coords.push_back(stop.coords_.longitude_);
+		stop_vertex_ids.push_back(stop.vertex_id_);
+		for (string_view bus_name : stop.buses_) {
+			stop_buses.push_back(bus_ids_.at(bus_name));
+		}
+		stop_bus_offsets.push_back(stop_buses.size());
+	}
+
+	vector<uint8_t> bus_types;
+	vector<uint32_t> bus_stop_offsets = { 0 };
+	vector<StopId> bus_stops;
+	vector<BusStats> bus_stats;
+	vector<Graph::EdgeId> bus_edge_ranges;
+	for (const Bus& bus : buses_) {
+		names += bus.name_;
+		bus_name_sizes.push_back(bus.name_.size());
+		bus_types.push_back(static_cast<uint8_t>(bus.type_));
+		bus_stops.insert(bus_stops.end(), bus.stops_.begin(), bus.stops_.end());
+		bus_stop_offsets.push_back(bus_stops.size());
+		bus_stats.push_back(bus.stats_);
+		bus_edge_ranges.push_back(bus.edges_begin_);
+		bus_edge_ranges.push_back(bus.edges_end_);
+	}
+
+	writer.WriteString(names);
+	writer.WriteArray(stop_name_sizes);
+	writer.WriteArray(stop_coords);
+	writer.WriteArray(stop_vertex_ids);
+	writer.WriteArray(stop_bus_offsets);
+	writer.WriteArray(stop_buses);
+	writer.WriteArray(bus_name_sizes);
+	writer.WriteArray(bus_types);
+	writer.WriteArray(bus_stop_offsets);
+	writer.WriteArray(bus_stops);
+	writer.WriteArray(bus_stats);
+	writer.WriteArray(bus_edge_ranges);
+
+	distances_.Save(writer);
+	writer.WriteArray(edge_info_);
+	graph.Save(writer);
+}
+
+TransportManager TransportManager::Load(Snapshot::Reader& reader) {
+	const int wait_time = reader.Read<int>();
+	TransportManager manager(0, wait_time, 0.0, 0.0);
+	manager.settings.velocity = reader.Read<double>();
+	manager.settings.pedestrian_velocity = reader.Read<double>();
+	manager.graph_model_ = reader.Read<GraphModel>();
+
+	string_view names = manager.names_->Add(reader.ReadString());
+	const auto stop_name_sizes = reader.ReadArray<uint32_t>();
+	const auto stop_coords = reader.ReadArray<double>();
+	const auto stop_vertex_ids = reader.ReadArray<Graph::VertexId>();
+	const auto stop_bus_offsets = reader.ReadArray<uint32_t>();
+	const auto stop_buses = reader.ReadArray<BusId>();
+	const auto bus_name_sizes = reader.ReadArray<uint32_t>();
+	const auto bus_types = reader.ReadArray<uint8_t>();
+	const auto bus_stop_offsets = reader.ReadArray<uint32_t>();
+	const auto bus_stops = reader.ReadArray<StopId>();
+	const auto bus_stats = reader.ReadArray<BusStats>();
+	const auto bus_edge_ranges = reader.ReadArray<Graph::EdgeId>();
+
+	auto take_name = [&names](uint32_t size) {
+		const string_view name = names.substr(0, size);
+		names.remove_prefix(name.size());
+		return name;
+	};
+
+	manager.stops_.reserve(stop_name_sizes.size());
+	manager.stop_ids_.reserve(stop_name_sizes.size());
+	for (StopId stop_id = 0; stop_id < stop_name_sizes.size(); ++stop_id) {
+		const auto coords = GeoCoordinates::FromRadian(stop_coords[stop_id * 2], stop_coords[stop_id * 2 + 1]);
+		manager.stops_.push_back({ take_name(stop_name_sizes[stop_id]), coords, {}, stop_vertex_ids[stop_id] });
+		manager.stop_ids_.emplace(manager.stops_.back().name_, stop_id);
+	}
+
+	manager.buses_.reserve(bus_name_sizes.size());
+	manager.bus_ids_.reserve(bus_name_sizes.size());
+	for (BusId bus_id = 0; bus_id < bus_name_sizes.size(); ++bus_id) {
+		manager.buses_.push_back({
+			take_name(bus_name_sizes[bus_id]),
+			static_cast<Bus::Type>(bus_types[bus_id]),
+			vector<StopId>(bus_stops.begin() + bus_stop_offsets[bus_id], bus_stops.begin() + bus_stop_offsets[bus_id + 1]),
+			bus_stats[bus_id],
+			bus_edge_ranges[bus_id * 2],
+			bus_edge_ranges[bus_id * 2 + 1]
+		});
+		manager.bus_ids_.emplace(manager.buses_.back().name_, bus_id);
 	}
 
-	ConstStopRawPtr from_ptr = &(*from_it), to_ptr = &(*to_it);
-	if (distances_.count(from_ptr) < 1 || distances_.at(from_ptr).count(to_ptr) < 1) {
-		return ComputeDistanceForCoords(from_ptr->second.coords_, to_ptr->second.coords_);
+	for (StopId stop_id = 0; stop_id < manager.stops_.size(); ++stop_id) {
+		auto& buses = manager.stops_[stop_id].buses_;
+		for (uint32_t idx = stop_bus_offsets[stop_id]; idx < stop_bus_offsets[stop_id + 1]; ++idx) {
+			buses.push_back(manager.buses_[stop_buses[idx]].name_);
+		}
 	}
-	return distances_.at(from_ptr).at(to_ptr);
+
+	manager.distances_.Load(reader);
+	manager.edge_info_ = reader.ReadArray<EdgeInfo>();
+	manager.graph = Graph::DirectedWeightedGraph<EdgeWeight>::Load(reader);
+
+	manager.vertex_stops_.resize(manager.graph.GetVertexCount());
+	for (StopId stop_id = 0; stop_id < manager.stops_.size(); ++stop_id) {
+		const Graph::VertexId vertex_id = manager.stops_[stop_id].vertex_id_;
+		manager.vertex_stops_[vertex_id] = manager.vertex_stops_[vertex_id + 1] = stop_id;
+	}
+	manager.BuildStopIndex();
+	return manager;
+}
+
+GraphModel TransportManager::GetGraphModel() const {
+	return graph_model_;
 }
 
 const Graph::DirectedWeightedGraph<EdgeWeight>& TransportManager::GetGraph() const {
@@ -170,18 +443,10 @@ int TransportManager::GetBusWaitTime() const {
 double TransportManager::GetBusVelocity() const {
 	return settings.velocity;
 }
-const Graph::Edge<EdgeWeight>& TransportManager::GetGraphEdge(Graph::EdgeId edge_id) const {
-	return graph.GetEdge(edge_id);
-}
 
-TransportManager::EdgeInfo::EdgeInfo()
-	: stops_count(0),
-	bus_ptr(nullptr)
-{
+double TransportManager::GetPedestrianVelocity() const {
+	return settings.pedestrian_velocity;
 }
-
-TransportManager::EdgeInfo::EdgeInfo(int32_t stops_count_, TransportManager::ConstBusRawPtr bus_ptr_)
-	: stops_count(stops_count_),
-	bus_ptr(bus_ptr_)
-{
+const Graph::Edge<EdgeWeight>& TransportManager::GetGraphEdge(Graph::EdgeId edge_id) const {
+	return graph.GetEdge(edge_id);
 }
\ No newline at end of file
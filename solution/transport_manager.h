@@ -1,10 +1,15 @@
 #pragma once
 
 #include "router.h"
+#include "string_pool.h"
+#include "road_distances.h"
+#include "snapshot.h"
+#include "stop_index.h"
 
+#include <array>
 #include <vector>
 #include <unordered_map>
-#include <set>
+#include <cstdint>
 #include <string_view>
 #include <optional>
 #include <memory>
@@ -12,19 +17,47 @@
 
 struct GeoCoordinates {
 	GeoCoordinates(double latitude_degree, double longitude_degree);
+	static GeoCoordinates FromRadian(double latitude, double longitude);
 
 	static double ToRadian(double degree);
+	static double ToDegree(double radian);
 
 	double latitude_, longitude_;
+	// Taken once at construction; replace whole coordinates rather than assigning the
+	// angles above
+	double sin_latitude_, cos_latitude_;
+	// The point on the unit sphere
+	std::array<double, 3> unit_vector_;
 };
 
 GeoCoordinates ParseGeoCoordinates(std::string_view str);
 
+// Spherical law of cosines, the distance every Bus and Route answer has always been
+// computed with; the cached latitude terms leave one cos and one acos per pair and give
+// the same values bit for bit
 double ComputeDistanceForCoords(const GeoCoordinates& lhs, const GeoCoordinates& rhs);
+// Haversine distance in its chord form: one sqrt and one asin over the cached unit vectors.
+// Exact for nearby points, where the law of cosines loses digits; used for walks.
+double ComputeStableDistanceForCoords(const GeoCoordinates& lhs, const GeoCoordinates& rhs);
 
-enum class EdgeType {
+// Convex hull of the points taken as planar longitude/latitude, counterclockwise from the
+// southernmost of the westernmost points, without collinear points
+std::vector<GeoCoordinates> ComputeConvexHull(std::vector<GeoCoordinates> points);
+
+enum class EdgeType : uint32_t {
 	BUS,
-	WAIT
+	WAIT,
+	BOARD,
+	RIDE,
+	ALIGHT
+};
+
+// COMPLETE links every stop of a bus to every later one with a single BUS edge.
+// ROUTE_PATTERN gives each position of a bus a ride vertex chained by RIDE edges,
+// entered by BOARD and left by ALIGHT edges, so edge count is linear in route length.
+enum class GraphModel {
+	COMPLETE,
+	ROUTE_PATTERN
 };
 
 struct EdgeWeight {
@@ -32,26 +65,42 @@ struct EdgeWeight {
 	EdgeWeight(EdgeType type, double weight);
 
 	EdgeType type_;
+	// Edge weights are written to snapshots as is, so the bytes after type_ are zeroed
+	uint32_t reserved_ = 0;
 	double weight_;
 
 	EdgeWeight& operator += (const EdgeWeight& other);
 	operator double() const;
 };
 EdgeWeight operator + (const EdgeWeight& lhs, const EdgeWeight& rhs);
-
-struct EdgeInfo;
-
-
+static_assert(sizeof(EdgeWeight) == sizeof(uint32_t) * 2 + sizeof(double), "EdgeWeight must have no padding");
 
 class TransportManager {
 public:
+	using StopId = uint32_t;
+	using BusId = uint32_t;
+
 	struct Stop {
+		std::string_view name_;
 		GeoCoordinates coords_;
-		std::set<std::string_view> buses_;
+		// Names of the buses through the stop, sorted and unique
+		std::vector<std::string_view> buses_;
+		// The wait vertex always follows the stop vertex
+		Graph::VertexId vertex_id_ = 0;
+	};
+
+	struct Distance {
+		double raw_ = 0.0;
+		double by_default_ = 0.0;
+		double Curvature() const;
+	};
+
+	// Everything a Bus request reports, computed once when the bus is built
+	struct BusStats {
+		Distance length_;
+		int32_t stop_count_ = 0;
+		int32_t unique_stop_count_ = 0;
 	};
-	using Stops = std::unordered_map<std::string, Stop>;
-	using StopRawPtr = Stops::pointer;
-	using ConstStopRawPtr = Stops::const_pointer;
 
 	struct Bus {
 		enum class Type {
@@ -59,73 +108,98 @@ public:
 			REGULAR
 		};
 
+		std::string_view name_;
 		Type type_ = Type::REGULAR;
-		std::vector<ConstStopRawPtr> stops_;
+		std::vector<StopId> stops_;
+		BusStats stats_;
+		// Edges generated for the bus, replaced as a whole when it is rebuilt
+		Graph::EdgeId edges_begin_ = 0;
+		Graph::EdgeId edges_end_ = 0;
 	};
 
-	using Buses = std::unordered_map<std::string, Bus>;
-
-	using BusRawPtr = Buses::pointer;
-	using ConstBusRawPtr = Buses::const_pointer;
-
-	using Distances = std::unordered_map<ConstStopRawPtr, std::unordered_map<ConstStopRawPtr, double>>;
-
-	struct Distance {
-		double raw_ = 0.0;
-		double by_default_ = 0.0;
-		double Curvature() const;
-	};
+	using Distances = RoadDistances;
 
 	struct RoutingSettings {
-		RoutingSettings(int wait, double velocity_in_kmph);
+		RoutingSettings(int wait, double velocity_in_kmph, double pedestrian_velocity_in_kmph);
 
 		int wait_time;
 		double velocity;
+		double pedestrian_velocity;
 	};
 
-	struct EdgeInfo {
-		EdgeInfo();
-		EdgeInfo(int32_t stops_count_, TransportManager::ConstBusRawPtr bus_ptr_);
+	struct NearbyStop {
+		StopId id;
+		double distance;
+	};
 
-		int32_t stops_count;
-		TransportManager::ConstBusRawPtr bus_ptr;
+	// Indexed by EdgeId; wait, board and alight edges keep the default value
+	struct EdgeInfo {
+		int32_t stops_count = 0;
+		BusId bus_id = 0;
 	};
 
 	friend class TransportManagerBuilder;
 
 public:
-	ConstStopRawPtr SetStop(std::string stop_id, Stop stop);
-	StopRawPtr GetStop(const std::string& stop_id);
-	ConstStopRawPtr GetStop(const std::string& stop_id) const;
-	BusRawPtr SetBus(std::string bus_id, Bus info);
-	ConstBusRawPtr GetBus(const std::string& bus_id) const;
-
-	ConstStopRawPtr GetStopByVertexId(Graph::VertexId id) const;
-	Graph::VertexId GetVertexIdByStop(const std::string& stop_id) const;
-	Graph::VertexId GetVertexIdByWaitStop(const std::string& stop_id) const;
+	StopId AddStop(std::string_view name, GeoCoordinates coords, Graph::VertexId vertex_id);
+	const Stop* GetStop(std::string_view name) const;
+	const Stop& GetStop(StopId id) const;
+	std::optional<StopId> FindStopId(std::string_view name) const;
+	size_t GetStopCount() const;
+	// Up to count stops nearest to coords by great-circle distance, nearest first
+	std::vector<NearbyStop> FindNearestStops(const GeoCoordinates& coords, size_t count) const;
+
+	BusId AddBus(std::string_view name, Bus::Type type);
+	const Bus* GetBus(std::string_view name) const;
+	const Bus& GetBus(BusId id) const;
+
+	Graph::VertexId GetVertexIdByStop(StopId id) const;
+	Graph::VertexId GetVertexIdByWaitStop(StopId id) const;
+	Graph::VertexId GetVertexIdByWaitStop(std::string_view name) const;
+	const Stop& GetStopByVertexId(Graph::VertexId id) const;
+	// nullptr unless id is the wait vertex of a stop
+	const Stop* FindStopByWaitVertex(Graph::VertexId id) const;
 	const EdgeInfo& GetEdgeInfoByEdgeId(Graph::EdgeId id) const;
 
+	GraphModel GetGraphModel() const;
 	const Graph::DirectedWeightedGraph<EdgeWeight>& GetGraph() const;
 	const Graph::Edge<EdgeWeight>& GetGraphEdge(Graph::EdgeId edge_id) const;
 
-	Distance ComputeDistanceForStop(const std::string& bus_id) const;
+	Distance ComputeDistanceForBus(const Bus& bus) const;
+	BusStats ComputeBusStats(const Bus& bus) const;
 
 	int GetBusWaitTime() const;
 	double GetBusVelocity() const;
+	double GetPedestrianVelocity() const;
 
+	void SetDistance(StopId from, StopId to, double distance);
+	double GetDistance(StopId from, StopId to) const;
 
-	double GetDistance(const std::string& from, const std::string& to) const;
+	// Stores everything built from the base requests, graph included
+	void Save(Snapshot::Writer& writer) const;
+	static TransportManager Load(Snapshot::Reader& reader);
 private:
 
-	TransportManager(size_t stops_count, int bus_wait_time, double bus_velocity_in_kmph);
+	TransportManager(size_t stops_count, int bus_wait_time, double bus_velocity_in_kmph,
+									 double pedestrian_velocity_in_kmph);
+
+	Graph::EdgeId AddEdge(const Graph::Edge<EdgeWeight>& edge);
+	Graph::EdgeId AddEdge(const Graph::Edge<EdgeWeight>& edge, EdgeInfo info);
+	// Must follow any change to the set of stops or their coordinates
+	void BuildStopIndex();
 
 	RoutingSettings settings;
-	Stops stops_;
-	Buses buses_;
+	GraphModel graph_model_ = GraphModel::COMPLETE;
+	// Shared by copies of the manager: names are only ever appended, so views handed
+	// out by one copy stay valid while another one adds stops or buses
+	std::shared_ptr<StringPool> names_ = std::make_shared<StringPool>();
+	std::vector<Stop> stops_;
+	std::vector<Bus> buses_;
+	std::vector<StopId> vertex_stops_;
+	std::unordered_map<std::string_view, StopId> stop_ids_;
+	std::unordered_map<std::string_view, BusId> bus_ids_;
 	Distances distances_;
-	std::unordered_map<Graph::VertexId, ConstStopRawPtr> vertex_id_to_stop;
-	std::unordered_map<ConstStopRawPtr, Graph::VertexId> stop_to_vertex_id;
-	std::unordered_map<ConstStopRawPtr, Graph::VertexId> wait_stop_to_vertex_id;
-	std::unordered_map<Graph::EdgeId, EdgeInfo> edge_id_to_info;
+	std::vector<EdgeInfo> edge_info_;
+	StopIndex stop_index_;
 	Graph::DirectedWeightedGraph<EdgeWeight> graph;
 };
\ No newline at end of file
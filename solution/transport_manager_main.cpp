@@ -1,9 +1,15 @@
 #include "transport_manager.h"
 #include "requests.h"
 #include "json.h"
+#include "profile.h"
+#include "versioned.h"
 
+#include <algorithm>
+#include <numeric>
+#include <atomic>
 #include <mutex>
 #include <future>
+#include <thread>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
@@ -24,6 +30,18 @@ public:
 		velocity_in_kmph_ = velocity_in_kmph;
 	}
 
+	void SetPedestrianVelocity(double velocity_in_kmph) {
+		pedestrian_velocity_in_kmph_ = velocity_in_kmph;
+	}
+
+	void SetGraphModel(GraphModel model) {
+		graph_model_ = model;
+	}
+
+	void SetThreadCount(size_t thread_count) {
+		thread_count_ = thread_count;
+	}
+
 	void AddQuery(const Json::Node& node) {
 		const auto& mapped_node = node.AsMap();
 		if (mapped_node.at("type"s).AsString() == "Stop"s) {
@@ -39,194 +57,504 @@ public:
 	}
 
 	TransportManager Build() const {
-		TransportManager manager(stop_requests_.size() * 2, wait_time_, velocity_in_kmph_);
+		TransportManager manager(stop_requests_.size() * 2, wait_time_, velocity_in_kmph_, pedestrian_velocity_in_kmph_);
+		manager.graph_model_ = graph_model_;
 		BuildStops(manager);
+		manager.BuildStopIndex();
 		BuildDistances(manager);
 		BuildBuses(manager);
+		manager.graph.Finalize();
 		return manager;
 	}
 
+	// Stop and Bus requests in the base request format, applied to a built manager by Update()
+	void AddUpdate(const Json::Node& node) {
+		const auto& mapped_node = node.AsMap();
+		if (mapped_node.at("type"s).AsString() == "Stop"s) {
+			stop_updates_.push_back(&node);
+		}
+		else if (mapped_node.at("type"s).AsString() == "Bus"s) {
+			bus_updates_.push_back(&node);
+		}
+	}
+
+	// New stops get new vertices and existing ones new coordinates. Only the buses that
+	// were rerouted, or pass a stop whose coordinates or road distances changed, are
+	// rebuilt: their old edges are unlinked from the graph and new ones appended.
+	void Update(TransportManager& manager) const {
+		vector<bool> is_stop_changed;
+		auto mark_stop = [&is_stop_changed](TransportManager::StopId stop_id) {
+			if (is_stop_changed.size() <= stop_id) {
+				is_stop_changed.resize(stop_id + 1, false);
+			}
+			is_stop_changed[stop_id] = true;
+		};
+
+		for (auto stop_update : stop_updates_) {
+			const auto& request_map = stop_update->AsMap();
+			if (const auto stop_id = manager.FindStopId(request_map.at("name"s).AsString())) {
+				manager.stops_[*stop_id].coords_ = ParseCoordinates(request_map);
+				mark_stop(*stop_id);
+			}
+			else {
+				AddStop(manager, request_map, manager.graph.AddVertices(2));
+			}
+		}
+
+		for (auto stop_update : stop_updates_) {
+			const auto& request_map = stop_update->AsMap();
+			if (request_map.count("road_distances"s) < 1) {
+				continue;
+			}
+			mark_stop(*manager.FindStopId(request_map.at("name"s).AsString()));
+			for (const TransportManager::StopId to_id : AddDistances(manager, request_map)) {
+				mark_stop(to_id);
+			}
+		}
+
+		vector<bool> is_bus_changed(manager.buses_.size() + bus_updates_.size(), false);
+		for (auto bus_update : bus_updates_) {
+			is_bus_changed[UpdateBus(manager, bus_update->AsMap())] = true;
+		}
+		for (TransportManager::StopId stop_id = 0; stop_id < is_stop_changed.size(); ++stop_id) {
+			if (!is_stop_changed[stop_id]) {
+				continue;
+			}
+			for (string_view bus_name : manager.stops_[stop_id].buses_) {
+				is_bus_changed[manager.bus_ids_.at(bus_name)] = true;
+			}
+		}
+
+		for (TransportManager::BusId bus_id = 0; bus_id < manager.buses_.size(); ++bus_id) {
+			if (is_bus_changed[bus_id]) {
+				RebuildBus(manager, bus_id);
+			}
+		}
+		manager.graph.Finalize();
+		manager.BuildStopIndex();
+	}
+
 private:
 
 	void BuildStops(TransportManager& manager) const {
+		manager.stops_.reserve(stop_requests_.size());
 		for (auto stop_request : stop_requests_) {
 			const auto& request_map = stop_request->AsMap();
-			auto stop_ptr = manager.SetStop(
-				request_map.at("name"s).AsString(),
-				{ GeoCoordinates(
-						request_map.at("latitude"s).AsDouble(),
-						request_map.at("longitude"s).AsDouble()
-				) }
-			);
-
-			auto [it, is_inserted] = manager.stop_to_vertex_id.insert({
-				stop_ptr,
-				manager.stop_to_vertex_id.size() + manager.wait_stop_to_vertex_id.size()
-				});
-			manager.vertex_id_to_stop.insert({ it->second, stop_ptr });
+			AddStop(manager, request_map, manager.stops_.size() * 2);
+		}
+	}
 
-			auto [wait_it, is_wait_inserted] = manager.wait_stop_to_vertex_id.insert({
-				stop_ptr,
-				manager.stop_to_vertex_id.size() + manager.wait_stop_to_vertex_id.size()
-				});
+	static TransportManager::StopId AddStop(TransportManager& manager,
+																					const Json::Dict& request_map,
+																					Graph::VertexId vertex_id) {
+		const TransportManager::StopId stop_id = manager.AddStop(
+			request_map.at("name"s).AsString(),
+			ParseCoordinates(request_map),
+			vertex_id
+		);
+
+		manager.AddEdge({
+				manager.GetVertexIdByWaitStop(stop_id),
+				manager.GetVertexIdByStop(stop_id),
+				EdgeWeight(EdgeType::WAIT, manager.GetBusWaitTime())
+			});
+		return stop_id;
+	}
 
-			manager.graph.AddEdge({
-					wait_it->second,
-					it->second,
-					EdgeWeight(EdgeType::WAIT, manager.GetBusWaitTime())
-				});
-		}
+	static GeoCoordinates ParseCoordinates(const Json::Dict& request_map) {
+		return GeoCoordinates(
+			request_map.at("latitude"s).AsDouble(),
+			request_map.at("longitude"s).AsDouble()
+		);
 	}
 
 	void BuildDistances(TransportManager& manager) const {
+		size_t distance_count = 0;
 		for (auto distances_from_stop : distances_) {
-			const auto& request_map = distances_from_stop->AsMap();
-
-			auto from_ptr = manager.GetStop(request_map.at("name"s).AsString());
-
-			for (const auto& stop_to_distance : request_map.at("road_distances"s).AsMap()) {
-				auto to_ptr = manager.GetStop(stop_to_distance.first);
-				double distance = static_cast<double>(stop_to_distance.second.AsInt());
-				if (!(from_ptr && to_ptr)) {
-					throw invalid_argument(
-						"Valid Stops were expected: " +
-						request_map.at("name"s).AsString() + "&&" + stop_to_distance.first
-					);
-				}
+			distance_count += distances_from_stop->AsMap().at("road_distances"s).AsMap().size();
+		}
+		manager.distances_.Reserve(distance_count * 2);
 
-				manager.distances_[from_ptr][to_ptr] = distance;
-				if (
-					manager.distances_.count(to_ptr) < 1 ||
-					manager.distances_.at(to_ptr).count(from_ptr) < 1
-					) {
-					manager.distances_[to_ptr][from_ptr] = distance;
-				}
-			}
+		for (auto distances_from_stop : distances_) {
+			AddDistances(manager, distances_from_stop->AsMap());
 		}
 	}
 
-	void BuildBackEdgesForRegularBus(TransportManager& manager,
-																	 const vector<TransportManager::ConstStopRawPtr>& stops,
-																	 TransportManager::ConstBusRawPtr bus_ptr,
-																	 Graph::VertexId vertex_id,
-																	 int32_t stops_count, double weight) const {
-		optional<TransportManager::ConstStopRawPtr> last_stop_opt;
-		for (auto next_stop_ptr : Range(stops.crbegin(), stops.crend())) {
-			if (last_stop_opt) {
-				++stops_count;
-				weight += manager.GetDistance((*last_stop_opt)->first, next_stop_ptr->first) / 1000.0 / manager.GetBusVelocity();
-				const Graph::EdgeId edge_id = manager.graph.AddEdge({
-						vertex_id,
-						manager.GetVertexIdByWaitStop(next_stop_ptr->first),
-						EdgeWeight(EdgeType::BUS, weight)
-					});
+	// Returns the stops the distances lead to
+	static vector<TransportManager::StopId> AddDistances(TransportManager& manager,
+																											 const Json::Dict& request_map) {
+		vector<TransportManager::StopId> to_ids;
+		const auto from_id = manager.FindStopId(request_map.at("name"s).AsString());
+
+		for (const auto& stop_to_distance : request_map.at("road_distances"s).AsMap()) {
+			const auto to_id = manager.FindStopId(stop_to_distance.first);
+			double distance = stop_to_distance.second.AsDouble();
+			if (!(from_id && to_id)) {
+				throw invalid_argument(
+					"Valid Stops were expected: " +
+					string(request_map.at("name"s).AsString()) + "&&" + string(stop_to_distance.first)
+				);
+			}
+
+			manager.SetDistance(*from_id, *to_id, distance);
+			manager.distances_.SetImplied(*to_id, *from_id, distance);
+			to_ids.push_back(*to_id);
+		}
+		return to_ids;
+	}
 
-				manager.edge_id_to_info.insert({ edge_id, TransportManager::EdgeInfo(stops_count, bus_ptr) });
+	// Travel times between consecutive stops of a bus: forward[k] is the time from stop k
+	// to stop k + 1, backward[k] the time from stop k + 1 back to stop k
+	struct HopTimes {
+		vector<double> forward, backward;
+	};
+
+	HopTimes ComputeHopTimes(const TransportManager& manager,
+													 const vector<TransportManager::StopId>& stops, bool needs_wayback) const {
+		HopTimes hops;
+		if (stops.empty()) {
+			return hops;
+		}
+		hops.forward.reserve(stops.size() - 1);
+		for (size_t idx = 0; idx + 1 < stops.size(); ++idx) {
+			hops.forward.push_back(manager.GetDistance(stops[idx], stops[idx + 1]) / 1000.0 / manager.GetBusVelocity());
+		}
+		if (needs_wayback) {
+			hops.backward.reserve(stops.size() - 1);
+			for (size_t idx = 0; idx + 1 < stops.size(); ++idx) {
+				hops.backward.push_back(manager.GetDistance(stops[idx + 1], stops[idx]) / 1000.0 / manager.GetBusVelocity());
 			}
-			last_stop_opt = next_stop_ptr;
 		}
+		return hops;
 	}
 
+	// Edges of one or more buses, generated apart from the graph and appended to it in order
+	struct EdgeBuffer {
+		vector<Graph::Edge<EdgeWeight>> edges;
+		vector<TransportManager::EdgeInfo> infos;
+		// Where the edges of each buffered bus end
+		vector<size_t> bus_ends;
 
-	void BuildEdgesForBus(TransportManager& manager,
-												const vector<TransportManager::ConstStopRawPtr>& stops,
-												TransportManager::ConstBusRawPtr bus_ptr, bool needs_wayback) const {
-		for(auto it = stops.begin(); it!=stops.end(); ++it) {
-			auto stop_ptr = *it;
+		void Add(const Graph::Edge<EdgeWeight>& edge, TransportManager::EdgeInfo info = {}) {
+			edges.push_back(edge);
+			infos.push_back(info);
+		}
 
+		void Clear() {
+			edges.clear();
+			infos.clear();
+			bus_ends.clear();
+		}
+	};
+
+	// Weights are accumulated hop by hop in route order rather than taken as prefix-sum
+	// differences, so they are bit-identical to summing the distances along the way
+	void BuildEdgesForBus(const TransportManager& manager, EdgeBuffer& edges,
+												const vector<TransportManager::StopId>& stops,
+												const HopTimes& hops,
+												TransportManager::BusId bus_id, bool needs_wayback) const {
+		const size_t stop_count = stops.size();
+		for (size_t from = 0; from < stop_count; ++from) {
 			int32_t stops_count = 0;
 			double weight = 0.0;
-			Graph::VertexId vertex_id = manager.GetVertexIdByStop(stop_ptr->first);
+			const Graph::VertexId vertex_id = manager.GetVertexIdByStop(stops[from]);
 
-			TransportManager::ConstStopRawPtr last_stop_ptr = stop_ptr;
-			for (TransportManager::ConstStopRawPtr next_stop_ptr : Range(next(it), stops.end())) {
-				++stops_count;
-				weight += ((manager.GetDistance(last_stop_ptr->first, next_stop_ptr->first) / 1000.0) / manager.GetBusVelocity());
-				const Graph::EdgeId edge_id = manager.graph.AddEdge({
+			for (size_t to = from + 1; to < stop_count; ++to) {
+				weight += hops.forward[to - 1];
+				edges.Add({
 						vertex_id,
-						manager.GetVertexIdByWaitStop(next_stop_ptr->first),
+						manager.GetVertexIdByWaitStop(stops[to]),
 						EdgeWeight(EdgeType::BUS, weight)
-					});
-
-				manager.edge_id_to_info.insert({ edge_id, TransportManager::EdgeInfo(stops_count, bus_ptr) });
-
-				last_stop_ptr = next_stop_ptr;
+					},
+					{ ++stops_count, bus_id }
+				);
 			}
-			if (needs_wayback) {
-				BuildBackEdgesForRegularBus(manager, stops, bus_ptr, vertex_id, stops_count, weight);
+			if (!needs_wayback) {
+				continue;
+			}
+			for (size_t to = stop_count - 1; to-- > 0;) {
+				weight += hops.backward[to];
+				edges.Add({
+						vertex_id,
+						manager.GetVertexIdByWaitStop(stops[to]),
+						EdgeWeight(EdgeType::BUS, weight)
+					},
+					{ ++stops_count, bus_id }
+				);
 			}
 		}
 	}
-	
-	template <typename Container>
-	void BuildReversedEdgesForBus(TransportManager& manager,
-												const Container& stops,
-												TransportManager::ConstBusRawPtr bus_ptr) const {
-		for(auto it = stops.begin(); it!=stops.end(); ++it) {
-			auto stop_ptr = *it;
 
+	void BuildReversedEdgesForBus(const TransportManager& manager, EdgeBuffer& edges,
+																const vector<TransportManager::StopId>& stops,
+																const HopTimes& hops,
+																TransportManager::BusId bus_id) const {
+		for (size_t from = stops.size(); from-- > 0;) {
 			int32_t stops_count = 0;
 			double weight = 0.0;
-			Graph::VertexId vertex_id = manager.GetVertexIdByStop(stop_ptr->first);
+			const Graph::VertexId vertex_id = manager.GetVertexIdByStop(stops[from]);
 
-			TransportManager::ConstStopRawPtr last_stop_ptr = stop_ptr;
-			for (TransportManager::ConstStopRawPtr next_stop_ptr : Range(next(it), stops.end())) {
-				++stops_count;
-				weight += ((manager.GetDistance(last_stop_ptr->first, next_stop_ptr->first) / 1000.0) / manager.GetBusVelocity());
-				const Graph::EdgeId edge_id = manager.graph.AddEdge({
+			for (size_t to = from; to-- > 0;) {
+				weight += hops.backward[to];
+				edges.Add({
 						vertex_id,
-						manager.GetVertexIdByWaitStop(next_stop_ptr->first),
+						manager.GetVertexIdByWaitStop(stops[to]),
 						EdgeWeight(EdgeType::BUS, weight)
-					});
-
-				manager.edge_id_to_info.insert({ edge_id, TransportManager::EdgeInfo(stops_count, bus_ptr) });
-
-				last_stop_ptr = next_stop_ptr;
+					},
+					{ ++stops_count, bus_id }
+				);
 			}
 		}
 	}
 
+	static size_t CountRideVertices(size_t stops_count, bool is_roundtrip) {
+		return is_roundtrip || stops_count == 0 ?
+			stops_count :
+			stops_count * 2 - 1;
+	}
 
+	void BuildRidesForBus(const TransportManager& manager, EdgeBuffer& edges,
+												const vector<TransportManager::StopId>& stops,
+												const HopTimes& hops,
+												TransportManager::BusId bus_id, bool needs_wayback,
+												Graph::VertexId ride_vertex_id) const {
+		vector<TransportManager::StopId> pattern = stops;
+		vector<double> pattern_hops = hops.forward;
+		if (needs_wayback && !stops.empty()) {
+			pattern.insert(pattern.end(), next(stops.crbegin()), stops.crend());
+			pattern_hops.insert(pattern_hops.end(), hops.backward.crbegin(), hops.backward.crend());
+		}
 
+		for (size_t idx = 0; idx < pattern.size(); ++idx, ++ride_vertex_id) {
+			const TransportManager::StopId stop_id = pattern[idx];
+			if (idx + 1 < pattern.size()) {
+				edges.Add({
+						manager.GetVertexIdByStop(stop_id),
+						ride_vertex_id,
+						EdgeWeight(EdgeType::BOARD, 0.0)
+					});
 
-	void BuildBuses(TransportManager& manager) const {
+				edges.Add({
+						ride_vertex_id,
+						ride_vertex_id + 1,
+						EdgeWeight(EdgeType::RIDE, pattern_hops[idx])
+					},
+					{ 1, bus_id }
+				);
+			}
+			if (idx > 0) {
+				edges.Add({
+						ride_vertex_id,
+						manager.GetVertexIdByWaitStop(stop_id),
+						EdgeWeight(EdgeType::ALIGHT, 0.0)
+					});
+			}
+		}
+	}
+
+	// Registers the buses and their stops; returns the first ride vertex of every bus.
+	// A repeated bus name replaces the earlier route, as a Bus update does.
+	vector<Graph::VertexId> RegisterBuses(TransportManager& manager) const {
+		manager.buses_.reserve(bus_requests_.size());
 		for (const auto& bus_request : bus_requests_) {
 			const auto& request_map = bus_request->AsMap();
 
-			auto bus_ptr = manager.SetBus(request_map.at("name"s).AsString(), {});
+			const TransportManager::BusId bus_id = manager.AddBus(request_map.at("name"s).AsString(), ParseBusType(request_map));
+			TransportManager::Bus& bus = manager.buses_[bus_id];
+			bus.type_ = ParseBusType(request_map);
+			bus.stops_ = ParseBusStops(manager, request_map);
+		}
+
+		size_t ride_vertex_count = 0;
+		vector<Graph::VertexId> ride_vertex_ids;
+		ride_vertex_ids.reserve(manager.buses_.size());
+		for (const auto& bus : manager.buses_) {
+			for (const TransportManager::StopId stop_id : bus.stops_) {
+				manager.stops_[stop_id].buses_.push_back(bus.name_);
+			}
+			ride_vertex_ids.push_back(ride_vertex_count);
+			ride_vertex_count += CountRideVertices(bus.stops_.size(), bus.type_ == TransportManager::Bus::Type::CIRCULAR);
+		}
+		if (graph_model_ == GraphModel::ROUTE_PATTERN) {
+			const Graph::VertexId first_ride_vertex_id = manager.graph.AddVertices(ride_vertex_count);
+			for (auto& ride_vertex_id : ride_vertex_ids) {
+				ride_vertex_id += first_ride_vertex_id;
+			}
+		}
 
-			TransportManager::Bus& bus = bus_ptr->second;
+		for (auto& stop : manager.stops_) {
+			sort(stop.buses_.begin(), stop.buses_.end());
+			stop.buses_.erase(unique(stop.buses_.begin(), stop.buses_.end()), stop.buses_.end());
+		}
+		return ride_vertex_ids;
+	}
 
-			bus.type_ = request_map.at("is_roundtrip"s).AsBool() ?
-									TransportManager::Bus::Type::CIRCULAR :
-									TransportManager::Bus::Type::REGULAR;
+	static TransportManager::Bus::Type ParseBusType(const Json::Dict& request_map) {
+		return request_map.at("is_roundtrip"s).AsBool() ?
+			TransportManager::Bus::Type::CIRCULAR :
+			TransportManager::Bus::Type::REGULAR;
+	}
 
-			const auto& stops = request_map.at("stops"s).AsArray();
+	static vector<TransportManager::StopId> ParseBusStops(const TransportManager& manager,
+																												const Json::Dict& request_map) {
+		vector<TransportManager::StopId> stops;
+		for (const auto& stop : request_map.at("stops"s).AsArray()) {
+			const auto stop_id = manager.FindStopId(stop.AsString());
+			if (!stop_id) {
+				throw invalid_argument("valid stop expected: " + string(stop.AsString()));
+			}
+			stops.push_back(*stop_id);
+		}
+		return stops;
+	}
 
-			for (const auto& stop : stops) {
-				auto stop_ptr = manager.GetStop(stop.AsString());
-				if (!stop_ptr) {
-					throw invalid_argument("valid stop expected: " + stop.AsString());
-				}
-				bus.stops_.push_back(stop_ptr);
-				stop_ptr->second.buses_.insert(bus_ptr->first);
+	// Adds the bus or replaces its route, keeping the bus lists of the stops in order
+	static TransportManager::BusId UpdateBus(TransportManager& manager, const Json::Dict& request_map) {
+		const string_view name = request_map.at("name"s).AsString();
+		vector<TransportManager::StopId> stops = ParseBusStops(manager, request_map);
+
+		TransportManager::BusId bus_id;
+		if (const auto it = manager.bus_ids_.find(name); it != manager.bus_ids_.end()) {
+			bus_id = it->second;
+		}
+		else {
+			bus_id = manager.AddBus(name, ParseBusType(request_map));
+		}
+		TransportManager::Bus& bus = manager.buses_[bus_id];
+		bus.type_ = ParseBusType(request_map);
+
+		for (const TransportManager::StopId stop_id : bus.stops_) {
+			auto& buses = manager.stops_[stop_id].buses_;
+			if (const auto it = lower_bound(buses.begin(), buses.end(), bus.name_); it != buses.end() && *it == bus.name_) {
+				buses.erase(it);
+			}
+		}
+		bus.stops_ = move(stops);
+		for (const TransportManager::StopId stop_id : bus.stops_) {
+			auto& buses = manager.stops_[stop_id].buses_;
+			if (const auto it = lower_bound(buses.begin(), buses.end(), bus.name_); it == buses.end() || *it != bus.name_) {
+				buses.insert(it, bus.name_);
 			}
+		}
+		return bus_id;
+	}
 
-			BuildEdgesForBus(manager, bus.stops_, bus_ptr, bus.type_ == TransportManager::Bus::Type::REGULAR);
+	void RebuildBus(TransportManager& manager, TransportManager::BusId bus_id) const {
+		const TransportManager::Bus& bus = manager.buses_[bus_id];
+		vector<Graph::EdgeId> old_edges(bus.edges_end_ - bus.edges_begin_);
+		iota(old_edges.begin(), old_edges.end(), bus.edges_begin_);
+		manager.graph.RemoveEdges(old_edges);
+
+		// The ride vertices of the old route are left isolated
+		Graph::VertexId ride_vertex_id = 0;
+		if (manager.graph_model_ == GraphModel::ROUTE_PATTERN) {
+			ride_vertex_id = manager.graph.AddVertices(
+				CountRideVertices(bus.stops_.size(), bus.type_ == TransportManager::Bus::Type::CIRCULAR)
+			);
+		}
+
+		EdgeBuffer edges;
+		BuildBus(manager, bus_id, ride_vertex_id, edges);
+		AppendEdges(manager, edges, bus_id);
+	}
 
-			if (bus.type_ == TransportManager::Bus::Type::REGULAR) {
-				BuildReversedEdgesForBus(manager, Range(bus.stops_.crbegin(), bus.stops_.crend()), bus_ptr);
+	// Only reads stops and distances and writes the bus's own stats, so buses can be
+	// built concurrently
+	void BuildBus(TransportManager& manager, TransportManager::BusId bus_id,
+								Graph::VertexId ride_vertex_id, EdgeBuffer& edges) const {
+		TransportManager::Bus& bus = manager.buses_[bus_id];
+		bus.stats_ = manager.ComputeBusStats(bus);
+
+		const bool needs_wayback = bus.type_ == TransportManager::Bus::Type::REGULAR;
+		const HopTimes hops = ComputeHopTimes(manager, bus.stops_, needs_wayback);
+		if (manager.graph_model_ == GraphModel::ROUTE_PATTERN) {
+			BuildRidesForBus(manager, edges, bus.stops_, hops, bus_id, needs_wayback, ride_vertex_id);
+		}
+		else {
+			BuildEdgesForBus(manager, edges, bus.stops_, hops, bus_id, needs_wayback);
+			if (needs_wayback) {
+				BuildReversedEdgesForBus(manager, edges, bus.stops_, hops, bus_id);
 			}
 		}
+		edges.bus_ends.push_back(edges.edges.size());
+	}
+
+	// Appends the edges of consecutive buses starting from first_bus_id and records
+	// the edge range of each
+	static void AppendEdges(TransportManager& manager, const EdgeBuffer& edges, TransportManager::BusId first_bus_id) {
+		size_t idx = 0;
+		for (size_t bus_idx = 0; bus_idx < edges.bus_ends.size(); ++bus_idx) {
+			TransportManager::Bus& bus = manager.buses_[first_bus_id + bus_idx];
+			bus.edges_begin_ = manager.graph.GetEdgeCount();
+			for (; idx < edges.bus_ends[bus_idx]; ++idx) {
+				manager.AddEdge(edges.edges[idx], edges.infos[idx]);
+			}
+			bus.edges_end_ = manager.graph.GetEdgeCount();
+		}
+	}
+
+	void BuildBuses(TransportManager& manager) const {
+		const vector<Graph::VertexId> ride_vertex_ids = RegisterBuses(manager);
+		const size_t bus_count = manager.buses_.size();
+
+		if (thread_count_ <= 1) {
+			EdgeBuffer edges;
+			for (TransportManager::BusId bus_id = 0; bus_id < bus_count; ++bus_id) {
+				BuildBus(manager, bus_id, ride_vertex_ids[bus_id], edges);
+				AppendEdges(manager, edges, bus_id);
+				edges.Clear();
+			}
+			return;
+		}
+
+		// Workers take chunks of consecutive buses; appending the chunks in order gives
+		// the same EdgeIds as the serial build
+		const size_t chunk_count = (bus_count + BUSES_PER_CHUNK - 1) / BUSES_PER_CHUNK;
+		vector<EdgeBuffer> chunks(chunk_count);
+		atomic<size_t> next_chunk = 0;
+
+		vector<future<void>> workers;
+		for (size_t worker = 0; worker < min(thread_count_, chunk_count); ++worker) {
+			workers.push_back(async(launch::async, [&] {
+				for (size_t chunk; (chunk = next_chunk++) < chunk_count;) {
+					const size_t chunk_end = min((chunk + 1) * BUSES_PER_CHUNK, bus_count);
+					for (size_t bus_id = chunk * BUSES_PER_CHUNK; bus_id < chunk_end; ++bus_id) {
+						BuildBus(manager, bus_id, ride_vertex_ids[bus_id], chunks[chunk]);
+					}
+				}
+			}));
+		}
+		for (auto& worker : workers) {
+			worker.get();
+		}
+
+		size_t edge_count = manager.graph.GetEdgeCount();
+		for (const auto& chunk : chunks) {
+			edge_count += chunk.edges.size();
+		}
+		manager.graph.ReserveEdges(edge_count);
+		manager.edge_info_.reserve(edge_count);
+
+		for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+			AppendEdges(manager, chunks[chunk], chunk * BUSES_PER_CHUNK);
+			chunks[chunk] = {};
+		}
 	}
 private:
+	static const size_t BUSES_PER_CHUNK = 64;
+	static constexpr double DEFAULT_PEDESTRIAN_VELOCITY = 5.0;
+
 	int wait_time_ = 0;
 	double velocity_in_kmph_ = 0.0;
+	double pedestrian_velocity_in_kmph_ = DEFAULT_PEDESTRIAN_VELOCITY;
+	GraphModel graph_model_ = GraphModel::COMPLETE;
+	size_t thread_count_ = 1;
 	std::vector<const Json::Node*> stop_requests_, bus_requests_, distances_;
+	std::vector<const Json::Node*> stop_updates_, bus_updates_;
 };
 
 TransportManagerBuilder ParseBaseRequests(const vector<Json::Node>& requests,
-																					const map<string, Json::Node>& routing_settings)
+																					const Json::Dict& routing_settings)
 {
 	TransportManagerBuilder builder;
 
@@ -234,6 +562,9 @@ TransportManagerBuilder ParseBaseRequests(const vector<Json::Node>& requests,
 		routing_settings.at("bus_wait_time"s).AsInt(),
 		routing_settings.at("bus_velocity"s).AsDouble()
 	);
+	if (routing_settings.count("pedestrian_velocity"s) > 0) {
+		builder.SetPedestrianVelocity(routing_settings.at("pedestrian_velocity"s).AsDouble());
+	}
 
 	for (const auto& node : requests) {
 		builder.AddQuery(node);
@@ -242,10 +573,97 @@ TransportManagerBuilder ParseBaseRequests(const vector<Json::Node>& requests,
 	return builder;
 }
 
+const unordered_map<string_view, Graph::RouterMode> STR_TO_ROUTER_MODE = {
+	{"all_pairs", Graph::RouterMode::ALL_PAIRS},
+	{"all_pairs_compact", Graph::RouterMode::ALL_PAIRS_COMPACT},
+	{"on_demand", Graph::RouterMode::ON_DEMAND},
+	{"contraction_hierarchy", Graph::RouterMode::CONTRACTION_HIERARCHY}
+};
+
+Graph::RouterMode ParseRouterMode(const Json::Dict& serving_settings) {
+	if (serving_settings.count("router"s) < 1) {
+		return Graph::RouterMode::ON_DEMAND;
+	}
+	const string_view mode_str = serving_settings.at("router"s).AsString();
+	if (const auto it = STR_TO_ROUTER_MODE.find(mode_str); it != STR_TO_ROUTER_MODE.end()) {
+		return it->second;
+	}
+	throw invalid_argument("Unknown router mode: " + string(mode_str));
+}
+
+const unordered_map<string_view, GraphModel> STR_TO_GRAPH_MODEL = {
+	{"complete", GraphModel::COMPLETE},
+	{"route_pattern", GraphModel::ROUTE_PATTERN}
+};
+
+GraphModel ParseGraphModel(const Json::Dict& serving_settings) {
+	if (serving_settings.count("graph_model"s) < 1) {
+		return GraphModel::COMPLETE;
+	}
+	const string_view model_str = serving_settings.at("graph_model"s).AsString();
+	if (const auto it = STR_TO_GRAPH_MODEL.find(model_str); it != STR_TO_GRAPH_MODEL.end()) {
+		return it->second;
+	}
+	throw invalid_argument("Unknown graph model: " + string(model_str));
+}
+
+bool IsProfilingEnabled(const Json::Dict& serving_settings) {
+	return serving_settings.count("profile"s) > 0 && serving_settings.at("profile"s).AsBool();
+}
+
+bool IsLiveUpdatesEnabled(const Json::Dict& serving_settings) {
+	return serving_settings.count("live_updates"s) > 0 && serving_settings.at("live_updates"s).AsBool();
+}
+
+size_t ParseRouteCacheSize(const Json::Dict& serving_settings) {
+	if (serving_settings.count("route_cache_size"s) < 1) {
+		return 0;
+	}
+	return max(serving_settings.at("route_cache_size"s).AsInt(), 0);
+}
+
+size_t ParseThreadCount(const Json::Dict& serving_settings) {
+	if (serving_settings.count("threads"s) < 1) {
+		return 1;
+	}
+	const int thread_count = serving_settings.at("threads"s).AsInt();
+	if (thread_count <= 0) {
+		return max(thread::hardware_concurrency(), 1u);
+	}
+	return thread_count;
+}
+
+// With a snapshot the router index is restored from it and its mode is the saved one.
+// Otherwise the mode is the given one, by default the one of the serving settings.
+Graph::Router<EdgeWeight> BuildRouter(const TransportManager& manager,
+																			const Json::Dict& serving_settings,
+																			Snapshot::Reader* snapshot = nullptr,
+																			optional<Graph::RouterMode> mode = nullopt)
+{
+	optional<LogDuration> duration;
+	if (IsProfilingEnabled(serving_settings)) {
+		duration.emplace("Router preprocessing"s);
+	}
+	if (snapshot) {
+		return Graph::Router<EdgeWeight>(manager.GetGraph(), *snapshot);
+	}
+	// Routes are only ever requested between wait vertices
+	vector<Graph::VertexId> sources(manager.GetStopCount());
+	for (TransportManager::StopId stop_id = 0; stop_id < sources.size(); ++stop_id) {
+		sources[stop_id] = manager.GetVertexIdByWaitStop(stop_id);
+	}
+	return Graph::Router<EdgeWeight>(manager.GetGraph(), mode.value_or(ParseRouterMode(serving_settings)),
+																		 ParseThreadCount(serving_settings), std::move(sources));
+}
+
 const unordered_map<string_view, Request::Type> STR_TO_REQUEST_TYPE = {
 	{"Bus", Request::Type::BUS},
 	{"Stop", Request::Type::STOP},
-	{"Route", Request::Type::ROUTE}
+	{"Route", Request::Type::ROUTE},
+	{"RouteMatrix", Request::Type::ROUTE_MATRIX},
+	{"NearestStops", Request::Type::NEAREST_STOPS},
+	{"GeoRoute", Request::Type::GEO_ROUTE},
+	{"Isochrone", Request::Type::ISOCHRONE}
 };
 
 optional<Request::Type> ConvertRequestTypeFromString(string_view type_str) {
@@ -258,7 +676,7 @@ optional<Request::Type> ConvertRequestTypeFromString(string_view type_str) {
 	}
 }
 
-RequestHolder ParseRequest(const map<string, Json::Node>& request_map) {
+RequestHolder ParseRequest(const Json::Dict& request_map) {
 	const auto req_type = ConvertRequestTypeFromString(request_map.at("type"s).AsString());
 	if (!req_type) {
 		return	nullptr;
@@ -282,45 +700,244 @@ vector<RequestHolder> ReadStatRequests(const vector<Json::Node>& stat_requests)
 	return requests;
 }
 
-Json::Document ProcessRequests(TransportManager& manager,
-															 Graph::Router<EdgeWeight>& router,
-															 const vector<RequestHolder>& requests)
+void ProcessRequest(const TransportManager& manager,
+										const Graph::Router<EdgeWeight>& router,
+										RouteCache* route_cache,
+										const Request& req_holder,
+										Json::Writer& writer,
+										size_t thread_count)
 {
-	vector<Json::Node> responses;
-	for (const auto& req_holder : requests) {
-		if (req_holder->type == Request::Type::BUS || req_holder->type == Request::Type::STOP) {
-			const auto& request = static_cast<const Requests::Read<Json::Node>&>(*req_holder);
-			responses.push_back(std::move(request.Process(manager)));
+	if (req_holder.type == Request::Type::BUS || req_holder.type == Request::Type::STOP ||
+			req_holder.type == Request::Type::NEAREST_STOPS) {
+		const auto& request = static_cast<const Requests::Read&>(req_holder);
+		request.Process(manager, writer);
+	}
+	else if (req_holder.type == Request::Type::ROUTE) {
+		const auto& request = static_cast<const Requests::RouteInfo&>(req_holder);
+		request.Process(manager, router, writer, route_cache);
+	}
+	else if (req_holder.type == Request::Type::ROUTE_MATRIX) {
+		const auto& request = static_cast<const Requests::RouteMatrix&>(req_holder);
+		request.Process(manager, router, writer, thread_count);
+	}
+	else if (req_holder.type == Request::Type::GEO_ROUTE) {
+		const auto& request = static_cast<const Requests::GeoRoute&>(req_holder);
+		request.Process(manager, router, writer);
+	}
+	else if (req_holder.type == Request::Type::ISOCHRONE) {
+		const auto& request = static_cast<const Requests::Isochrone&>(req_holder);
+		request.Process(manager, router, writer);
+	}
+	// ...
+}
+
+// The manager together with the router built over its graph and the responses
+// rendered from them; a route cache of zero size disables caching
+struct ServingState {
+	template <typename RouterFactory>
+	ServingState(TransportManager manager_, RouterFactory make_router, size_t route_cache_size)
+		: manager(std::move(manager_)),
+			router(make_router(manager)),
+			route_cache(route_cache_size > 0 ? make_unique<RouteCache>(route_cache_size) : nullptr)
+	{
+	}
+
+	TransportManager manager;
+	Graph::Router<EdgeWeight> router;
+	unique_ptr<RouteCache> route_cache;
+};
+
+const size_t REQUESTS_PER_SHARD = 4096;
+
+void ProcessShard(const Versioned<ServingState>& serving,
+									const vector<RequestHolder>& requests,
+									size_t shard_begin, size_t shard_end,
+									Json::Writer& writer,
+									size_t thread_count)
+{
+	// Every shard pins the latest published version and answers from it alone
+	const auto state = serving.Pin();
+	for (size_t idx = shard_begin; idx < shard_end; ++idx) {
+		ProcessRequest(state->manager, state->router, state->route_cache.get(), *requests[idx], writer, thread_count);
+	}
+}
+
+// With several threads the requests are answered in windows of thread_count shards;
+// every shard renders into its own buffer and the buffers are spliced back in order,
+// so the output is identical to the serial one and memory is bounded by the window.
+void ProcessRequests(const Versioned<ServingState>& serving,
+										 const vector<RequestHolder>& requests,
+										 Json::Writer& writer,
+										 size_t thread_count = 1)
+{
+	writer.BeginArray();
+	if (thread_count <= 1) {
+		for (size_t shard_begin = 0; shard_begin < requests.size(); shard_begin += REQUESTS_PER_SHARD) {
+			ProcessShard(serving, requests, shard_begin, min(shard_begin + REQUESTS_PER_SHARD, requests.size()), writer, 1);
+		}
+		writer.EndArray();
+		return;
+	}
+
+	const size_t window_size = thread_count * REQUESTS_PER_SHARD;
+	for (size_t window_begin = 0; window_begin < requests.size(); window_begin += window_size) {
+		const size_t window_end = min(window_begin + window_size, requests.size());
+		// Threads left idle by a partial window go to the requests that can use them
+		const size_t shard_count = (window_end - window_begin + REQUESTS_PER_SHARD - 1) / REQUESTS_PER_SHARD;
+		const size_t request_thread_count = max<size_t>(thread_count / shard_count, 1);
+
+		vector<future<string>> shards;
+		for (size_t shard_begin = window_begin; shard_begin < window_end; shard_begin += REQUESTS_PER_SHARD) {
+			const size_t shard_end = min(shard_begin + REQUESTS_PER_SHARD, window_end);
+			shards.push_back(async(launch::async,
+				[&serving, &requests, shard_begin, shard_end, request_thread_count,
+				 shard_writer = writer.ItemWriter()]() mutable {
+					ProcessShard(serving, requests, shard_begin, shard_end, shard_writer, request_thread_count);
+					return shard_writer.ExtractBuffer();
+				}
+			));
 		}
-		else if (req_holder->type == Request::Type::ROUTE) {
-			const auto& request = static_cast<const Requests::RouteInfo&>(*req_holder);
-			responses.push_back(std::move(request.Process(manager, router)));
+
+		for (auto& shard : shards) {
+			writer.AppendItems(shard.get());
 		}
-		// ...
 	}
-	return Json::Document{ Json::Node(std::move(responses)) };
+	writer.EndArray();
 }
 
-void PrintResponses(const Json::Document& responses, ostream& os = cout) {
-	Json::Print(os, responses);
+const unordered_map<string_view, Json::Writer::Mode> STR_TO_OUTPUT_MODE = {
+	{"pretty", Json::Writer::Mode::PRETTY},
+	{"compact", Json::Writer::Mode::COMPACT}
+};
+
+Json::Writer::Mode ParseOutputMode(const Json::Dict& serving_settings) {
+	if (serving_settings.count("output"s) < 1) {
+		return Json::Writer::Mode::PRETTY;
+	}
+	const string_view mode_str = serving_settings.at("output"s).AsString();
+	if (const auto it = STR_TO_OUTPUT_MODE.find(mode_str); it != STR_TO_OUTPUT_MODE.end()) {
+		return it->second;
+	}
+	throw invalid_argument("Unknown output mode: " + string(mode_str));
+}
+
+TransportManager BuildTransportManager(const Json::Dict& requests,
+																			 const Json::Dict& serving_settings,
+																			 size_t thread_count)
+{
+	auto tm_builder = ParseBaseRequests(
+		requests.at("base_requests"s).AsArray(),
+		requests.at("routing_settings"s).AsMap()
+	);
+	tm_builder.SetGraphModel(ParseGraphModel(serving_settings));
+	tm_builder.SetThreadCount(thread_count);
+	return tm_builder.Build();
+}
+
+void ApplyUpdates(TransportManager& manager, const vector<Json::Node>& update_requests) {
+	TransportManagerBuilder updater;
+	for (const auto& node : update_requests) {
+		updater.AddUpdate(node);
+	}
+	updater.Update(manager);
+}
+
+// Applies the updates to a copy of the current version and publishes the result;
+// readers keep the version they pinned until they are done with it
+void PublishUpdates(Versioned<ServingState>& serving, const vector<Json::Node>& update_requests,
+										const Json::Dict& serving_settings)
+{
+	const auto current = serving.Pin();
+	TransportManager manager = current->manager;
+	ApplyUpdates(manager, update_requests);
+	// Every version keeps the router mode of the first one, which may come from a snapshot
+	const Graph::RouterMode mode = current->router.GetMode();
+	serving.Publish(make_shared<const ServingState>(
+		std::move(manager),
+		[&serving_settings, mode](const TransportManager& updated) {
+			return BuildRouter(updated, serving_settings, nullptr, mode);
+		},
+		ParseRouteCacheSize(serving_settings)
+	));
+}
+
+void SaveSnapshot(const TransportManager& manager, const Graph::Router<EdgeWeight>& router,
+									const string& path)
+{
+	Snapshot::Writer writer(path);
+	manager.Save(writer);
+	router.Save(writer);
+	writer.Finish();
 }
 
 int main() {
-	Json::Document document = Json::Load(cin);
+	Json::Document document = Json::LoadFile("/dev/stdin"s);
 	auto& requests = document.GetRoot().AsMap();
-	const vector<Json::Node>& base_requests = requests.at("base_requests"s).AsArray();
-	const map<string, Json::Node>& routing_settings = requests.at("routing_settings"s).AsMap();
+	const Json::Dict default_serving_settings;
+	const Json::Dict& serving_settings = requests.count("serving_settings"s) > 0 ?
+		requests.at("serving_settings"s).AsMap() :
+		default_serving_settings;
+	const size_t thread_count = ParseThreadCount(serving_settings);
+
+	// A snapshot replaces base_requests and routing_settings, and the router preprocessing
+	optional<Snapshot::Reader> snapshot;
+	if (serving_settings.count("load_snapshot"s) > 0) {
+		snapshot.emplace(string(serving_settings.at("load_snapshot"s).AsString()));
+	}
 
-	auto tm_builder = ParseBaseRequests(base_requests, routing_settings);
+	TransportManager transport_manager = snapshot ?
+		TransportManager::Load(*snapshot) :
+		BuildTransportManager(requests, serving_settings, thread_count);
+
+	// The saved router index no longer matches an updated graph, so it is recomputed then,
+	// in the saved mode
+	const bool has_updates = requests.count("update_requests"s) > 0;
+	const bool has_live_updates = has_updates && IsLiveUpdatesEnabled(serving_settings);
+	optional<Graph::RouterMode> router_mode;
+	if (has_updates && !has_live_updates) {
+		ApplyUpdates(transport_manager, requests.at("update_requests"s).AsArray());
+		if (snapshot) {
+			router_mode = snapshot->Read<Graph::RouterMode>();
+		}
+	}
+	Snapshot::Reader* router_snapshot = snapshot && !router_mode ? &*snapshot : nullptr;
+
+	Versioned<ServingState> serving(make_shared<const ServingState>(
+		std::move(transport_manager),
+		[&serving_settings, router_snapshot, router_mode](const TransportManager& manager) {
+			return BuildRouter(manager, serving_settings, router_snapshot, router_mode);
+		},
+		ParseRouteCacheSize(serving_settings)
+	));
+	snapshot.reset();
+
+	// Live updates are applied while the requests are being answered: shards started
+	// before the new version is published are answered from the old one
+	future<void> live_update;
+	if (has_live_updates) {
+		live_update = async(launch::async, [&serving, &requests, &serving_settings] {
+			PublishUpdates(serving, requests.at("update_requests"s).AsArray(), serving_settings);
+		});
+	}
 
-	TransportManager transport_manager = tm_builder.Build();
+	const auto& stat_requests = requests.at("stat_requests"s).AsArray();
+	auto stat_request_holders = ReadStatRequests(stat_requests);
+	Json::Writer writer(stdout, ParseOutputMode(serving_settings));
+	ProcessRequests(serving, stat_request_holders, writer, thread_count);
 
+	if (live_update.valid()) {
+		live_update.get();
+	}
 
-	Graph::Router<EdgeWeight> router(transport_manager.GetGraph());
+	const auto state = serving.Pin();
+	if (state->route_cache && IsProfilingEnabled(serving_settings)) {
+		const RouteCache::Stats stats = state->route_cache->GetStats();
+		cerr << "Route cache: " << stats.hits << " hits, " << stats.misses << " misses, "
+				 << stats.evictions << " evictions" << endl;
+	}
 
-	auto stat_requests = requests.at("stat_requests"s).AsArray();
-	auto stat_request_holders = ReadStatRequests(stat_requests);
-	Json::Document responses = ProcessRequests(transport_manager, router, stat_request_holders);
-	PrintResponses(responses);
+	if (serving_settings.count("save_snapshot"s) > 0) {
+		SaveSnapshot(state->manager, state->router, string(serving_settings.at("save_snapshot"s).AsString()));
+	}
 	return 0;
 }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <memory>
+#include <utility>
+
+// Read-copy-update holder. Readers pin the current version and may use it for as long
+// as they hold the pointer, whatever is published meanwhile; a writer prepares a new
+// version aside and publishes it atomically. A version is destroyed once the last
+// reader pinning it lets go.
+template <typename T>
+class Versioned {
+public:
+	using Version = std::shared_ptr<const T>;
+
+	explicit Versioned(Version initial)
+		: current_(std::move(initial))
+	{
+	}
+
+	Version Pin() const {
+		return std::atomic_load(&current_);
+	}
+
+	void Publish(Version next) {
+		std::atomic_store(&current_, std::move(next));
+	}
+
+private:
+	Version current_;
+};